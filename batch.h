@@ -0,0 +1,266 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "machine.h"
+#include "loader.h"
+
+/*
+Batch mode: run many (ROM, input) jobs to completion, each in its own Machine,
+spread over a work-stealing pool, and write one JSON line of results per job.
+
+Job list, one job per line, '#' starts a comment:
+    <image spec> [cycles=N] [input=ADDR:HEXBYTES]...
+e.g.
+    roms/test.bin cycles=1000000 input=0010:01ff
+    firmware.bin@e000,ro input=0200:05
+Image specs are described in loader.h. Inputs are written over the loaded
+image before reset.
+*/
+
+struct BatchInput {
+    uint16_t address;
+    std::vector<uint8_t> bytes;
+};
+
+struct BatchJob {
+    size_t id;
+    std::string rom;
+    uint64_t cycles;
+    std::vector<BatchInput> inputs;
+};
+
+// Each worker owns a deque and takes jobs from its front, idle workers
+// steal from the back of the others. Jobs never spawn jobs, so a plain
+// mutex per deque is all the synchronisation needed.
+class WorkStealingPool {
+    struct Queue {
+        std::mutex lock;
+        std::deque<size_t> jobs;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+
+    public:
+        explicit WorkStealingPool(size_t threads) {
+            for (size_t i = 0; i < std::max<size_t>(threads, 1); i++) {
+                queues.push_back(std::make_unique<Queue>());
+            }
+        }
+
+        size_t size() const {
+            return queues.size();
+        }
+
+        // Runs task(job, worker) for every job in [0, count) and waits for all of them
+        void run(size_t count, const std::function<void(size_t, size_t)>& task) {
+            // Contiguous ranges keep neighbouring jobs (often the same ROM) on one core
+            size_t chunk = (count + queues.size() - 1) / queues.size();
+            for (size_t job = 0; job < count; job++) {
+                queues[job / std::max<size_t>(chunk, 1)]->jobs.push_back(job);
+            }
+
+            std::vector<std::thread> workers;
+            for (size_t worker = 0; worker < queues.size(); worker++) {
+                workers.emplace_back([this, worker, &task] {
+                    size_t job;
+                    while (take(worker, job)) task(job, worker);
+                });
+            }
+
+            for (auto& thread: workers) thread.join();
+        }
+
+    private:
+        bool take(size_t worker, size_t& job) {
+            {
+                Queue& own = *queues[worker];
+                std::lock_guard<std::mutex> guard(own.lock);
+                if (!own.jobs.empty()) {
+                    job = own.jobs.front();
+                    own.jobs.pop_front();
+                    return true;
+                }
+            }
+
+            for (size_t i = 1; i < queues.size(); i++) {
+                Queue& victim = *queues[(worker + i) % queues.size()];
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (!victim.jobs.empty()) {
+                    job = victim.jobs.back();
+                    victim.jobs.pop_back();
+                    return true;
+                }
+            }
+
+            return false;
+        }
+};
+
+inline uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t hash=0xcbf29ce484222325ull) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+inline std::string jsonString(const std::string& text) {
+    std::string out = "\"";
+    for (char c: text) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+inline bool parseBatchJobs(std::istream& in, uint64_t defaultCycles, std::vector<BatchJob>& jobs, std::string& error) {
+    std::string line;
+    size_t lineNumber = 0;
+
+    while (std::getline(in, line)) {
+        lineNumber++;
+
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+
+        std::istringstream tokens(line);
+        BatchJob job;
+        if (!(tokens >> job.rom)) continue;
+
+        job.id = jobs.size();
+        job.cycles = defaultCycles;
+
+        std::string token;
+        while (tokens >> token) {
+            try {
+                if (token.rfind("cycles=", 0) == 0) {
+                    job.cycles = std::stoull(token.substr(7));
+                } else if (token.rfind("input=", 0) == 0 && token.size() > 11 && token[10] == ':') {
+                    BatchInput input;
+                    input.address = std::stoul(token.substr(6, 4), nullptr, 16);
+
+                    std::string hex = token.substr(11);
+                    if (hex.size() % 2 != 0) {
+                        error = "line " + std::to_string(lineNumber) + ": odd number of hex digits";
+                        return false;
+                    }
+                    for (size_t i = 0; i < hex.size(); i += 2) {
+                        input.bytes.push_back(std::stoul(hex.substr(i, 2), nullptr, 16));
+                    }
+
+                    job.inputs.push_back(input);
+                } else {
+                    error = "line " + std::to_string(lineNumber) + ": unknown field " + token;
+                    return false;
+                }
+            } catch (const std::exception&) {
+                error = "line " + std::to_string(lineNumber) + ": bad number in " + token;
+                return false;
+            }
+        }
+
+        jobs.push_back(job);
+    }
+
+    return true;
+}
+
+template <Variant variant=Variant::NMOS>
+bool runBatch(const std::string& jobsPath, const std::string& outPath, size_t threads, uint64_t defaultCycles) {
+    std::ifstream jobsFile(jobsPath);
+    if (!jobsFile) {
+        std::fprintf(stderr, "Cannot open job list %s\n", jobsPath.c_str());
+        return false;
+    }
+
+    std::vector<BatchJob> jobs;
+    std::string error;
+    if (!parseBatchJobs(jobsFile, defaultCycles, jobs, error)) {
+        std::fprintf(stderr, "%s: %s\n", jobsPath.c_str(), error.c_str());
+        return false;
+    }
+
+    // Every distinct image is mapped once and shared by all jobs using it
+    std::map<std::string, std::shared_ptr<Image>> images;
+    for (const BatchJob& job: jobs) {
+        if (images.count(job.rom)) continue;
+
+        images[job.rom] = Image::open(job.rom, error);
+        if (images[job.rom] == nullptr) {
+            std::fprintf(stderr, "%s\n", error.c_str());
+            return false;
+        }
+    }
+
+    std::FILE* out = std::fopen(outPath.c_str(), "w");
+    if (out == nullptr) {
+        std::fprintf(stderr, "Cannot open %s for writing\n", outPath.c_str());
+        return false;
+    }
+
+    std::mutex outLock;
+    std::atomic<uint64_t> totalCycles{0};
+
+    WorkStealingPool pool(threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency()));
+    auto start = std::chrono::steady_clock::now();
+
+    pool.run(jobs.size(), [&](size_t index, size_t) {
+        const BatchJob& job = jobs[index];
+        auto machine = std::make_unique<Machine<NoTrace, variant>>();
+        Image::load(images.at(job.rom), machine->bus);
+        for (const BatchInput& input: job.inputs) {
+            for (size_t i = 0; i < input.bytes.size(); i++) {
+                machine->bus.write(input.address + i, input.bytes[i]);
+            }
+        }
+
+        CPU<NoTrace, variant>& cpu = machine->cpu;
+        cpu.stopOnBRK = true;
+        cpu.stopOnHaltLoop = true;
+        cpu.reset();
+
+        RunResult result = cpu.runCycles(job.cycles);
+        totalCycles += result.cycles;
+
+        char registers[160];
+        std::snprintf(registers, sizeof(registers),
+            "\"a\":%u,\"x\":%u,\"y\":%u,\"sp\":%u,\"p\":%u,\"pc\":%u,\"memory\":\"%016llx\"",
+            cpu.accumulator, cpu.x, cpu.y, cpu.sp, cpu.getPSR(), cpu.pc,
+            (unsigned long long)fnv1a(machine->bus.memory, sizeof(machine->bus.memory)));
+
+        std::string line = "{\"job\":" + std::to_string(job.id) +
+            ",\"rom\":" + jsonString(job.rom) +
+            ",\"stop\":\"" + stopReasonNames[(int)result.reason] + "\"" +
+            ",\"cycles\":" + std::to_string(result.cycles) +
+            ",\"instructions\":" + std::to_string(result.instructions) +
+            "," + registers + "}\n";
+
+        std::lock_guard<std::mutex> guard(outLock);
+        std::fwrite(line.data(), 1, line.size(), out);
+    });
+
+    std::fclose(out);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::fprintf(stderr, "%zu jobs on %zu threads in %.3f s: %.1f jobs/s, %.1f MHz aggregate\n",
+        jobs.size(), pool.size(), seconds, jobs.size() / seconds, totalCycles / seconds / 1e6);
+
+    return true;
+}
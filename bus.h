@@ -0,0 +1,313 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <bitset>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "replay.h"
+
+class Scheduler;
+class InterruptLines;
+
+class Peripheral {
+    public:
+        std::string name;
+        
+        uint16_t start;
+        
+        virtual void write(uint8_t address, uint8_t value) = 0;
+        virtual uint8_t read(uint8_t address) = 0;
+
+        // Called once when the device is added to a machine. Devices that need
+        // time schedule their work here instead of running a thread.
+        virtual void attach(Scheduler& /* scheduler */, InterruptLines& /* interrupts */) {}
+
+        // Free-running devices with their own thread
+        virtual void run() {}
+
+        // Whether reads have no side effects and return the same until the
+        // CPU writes or one of the device's scheduled events runs. The CPU
+        // skips loops that poll such a device instead of running them.
+        virtual bool steadyReads() const {
+            return false;
+        }
+
+        // Device state for machine snapshots, nothing by default
+        virtual std::vector<uint8_t> saveState() {
+            return {};
+        }
+
+        virtual void loadState(const std::vector<uint8_t>& /* state */) {}
+
+        // Whether saveState() holds all the device's state, so History can go
+        // back past it
+        virtual bool rewindable() const {
+            return true;
+        }
+
+        virtual ~Peripheral() = default;
+};
+
+// Page table entry for one 256-byte page of the address space.
+// RAM/ROM pages hold direct host pointers, so an access is a single indexed load.
+// Pages a peripheral window touches have no host pointers and go through the
+// bus, device is the first peripheral on the page. What the windows leave of
+// such a page is RAM in Bus::memory.
+// A RAM page not written since the last snapshot, or holding cached code,
+// keeps its write pointer in clean, so the first write takes the slow path
+// once, marks it dirty and drops the cached code.
+struct Page {
+    uint8_t* read = nullptr;
+    uint8_t* write = nullptr;
+    Peripheral* device = nullptr;
+    uint8_t* clean = nullptr;
+};
+
+// Told when a page whose instructions were cached may have changed
+class CodeCache {
+    public:
+        virtual void invalidate(uint8_t page) = 0;
+};
+
+using PageData = std::array<uint8_t, 0x100>;
+
+// Contents of every RAM page, shared between snapshots while unchanged.
+// Null for ROM pages and pages wholly covered by devices.
+using PageSet = std::array<std::shared_ptr<const PageData>, 0x100>;
+
+// The 64 KB address space of one machine: memory, page table and attached devices
+class Bus {
+    // Writes to ROM pages land here and are dropped
+    uint8_t romSink[0x100];
+
+    // Pages written since the last snapshot or restore
+    std::bitset<0x100> dirty;
+
+    // What the clean pages hold: the last snapshot taken or restored
+    PageSet basis;
+
+    // Pages the code cache has decoded instructions from
+    std::bitset<0x100> codePages;
+
+    // Peripherals with a window on each page, in the order they were added.
+    // Windows that are not page aligned share pages, so there may be several.
+    std::array<std::vector<Peripheral*>, 0x100> windows;
+
+    // Device pages the windows do not cover all of, the rest is RAM
+    std::bitset<0x100> partial;
+
+    public:
+        uint8_t memory[0x10000] = {};
+
+        Page pages[0x100];
+
+        // List of peripherals, not owned
+        std::vector<Peripheral*> peripherals;
+
+        // Keeps host memory behind externally mapped pages (ROM images) alive
+        std::vector<std::shared_ptr<const void>> backing;
+
+        // Records or replays what devices return, when set
+        InputLog* inputLog = nullptr;
+
+        // The CPU's decoded instructions, when set
+        CodeCache* codeCache = nullptr;
+
+        // Reads and writes that reached a device, what its registers see on
+        // real hardware. RAM and ROM go through the page table or inlined JIT
+        // code and are not counted.
+        uint64_t deviceReads = 0;
+        uint64_t deviceWrites = 0;
+
+        Bus() {
+            mapMemory();
+            dirty.set();
+        }
+
+        // The page table points into this object
+        Bus(const Bus&) = delete;
+        Bus& operator=(const Bus&) = delete;
+
+        void mapPage(uint8_t page, uint8_t* host, bool writable=true) {
+            pages[page].read = host;
+            pages[page].write = writable ? host : romSink;
+            pages[page].device = nullptr;
+            pages[page].clean = nullptr;
+            windows[page].clear();
+            partial.reset(page);
+            dirty.set(page);
+            codeChanged(page);
+        }
+
+        void mapMemory() {
+            for (int page = 0; page < 0x100; page++) {
+                mapPage(page, &memory[page << 8]);
+            }
+        }
+
+        void addPeripheral(Peripheral* peripheral) {
+            peripherals.push_back(peripheral);
+
+            // A window that is not page aligned spills into the next page
+            int first = peripheral->start >> 8;
+            int last = std::min(peripheral->start + 0xff, 0xffff) >> 8;
+
+            for (int page = first; page <= last; page++) {
+                windows[page].push_back(peripheral);
+
+                pages[page].read = nullptr;
+                pages[page].write = nullptr;
+                pages[page].device = windows[page].front();
+                pages[page].clean = nullptr;
+                partial[page] = !covered(page);
+                dirty.set(page);
+                codeChanged(page);
+            }
+        }
+
+        // Write-protects a page instructions are cached from, so the first write drops them
+        void watchCode(uint8_t page) {
+            codePages.set(page);
+            protect(page);
+        }
+
+        // Captures RAM into pages. Only pages dirtied since the last
+        // snapshot or restore are copied, the rest are shared with it.
+        void savePages(PageSet& out) {
+            for (int page = 0; page < 0x100; page++) {
+                if (dirty[page]) {
+                    uint8_t* host = ramPage(page);
+                    if (host != nullptr) {
+                        auto data = std::make_shared<PageData>();
+                        std::memcpy(data->data(), host, 0x100);
+                        basis[page] = data;
+                    } else {
+                        basis[page] = nullptr;
+                    }
+                    protect(page);
+                }
+
+                out[page] = basis[page];
+            }
+
+            dirty.reset();
+        }
+
+        // Puts RAM back to pages, copying only what differs from the current contents
+        void loadPages(const PageSet& in) {
+            for (int page = 0; page < 0x100; page++) {
+                if (!dirty[page] && basis[page] == in[page]) continue;
+
+                uint8_t* host = ramPage(page);
+                if (host == nullptr || in[page] == nullptr) {
+                    // Mapped differently than when the snapshot was taken, left as is
+                    continue;
+                }
+
+                codeChanged(page);
+                std::memcpy(host, in[page]->data(), 0x100);
+                basis[page] = in[page];
+                dirty.reset(page);
+                protect(page);
+            }
+        }
+
+        void write(uint16_t address, uint8_t value) {
+            Page& page = pages[address >> 8];
+
+            if (page.write != nullptr) {
+                page.write[address & 0xff] = value;
+                return;
+            }
+
+            if (page.clean != nullptr) {
+                // First write since the last snapshot or since code was cached
+                dirty.set(address >> 8);
+                codeChanged(address >> 8);
+                page.write = page.clean;
+                page.clean = nullptr;
+                page.write[address & 0xff] = value;
+                return;
+            }
+
+            // Where windows overlap the earliest peripheral wins, same as the old linear scan
+            for (Peripheral* peripheral: windows[address >> 8]) {
+                if ((uint16_t)(address - peripheral->start) <= 0xff) {
+                    deviceWrites++;
+                    peripheral->write((uint8_t)address, value);
+                    return;
+                }
+            }
+
+            // RAM beside a window has no clean pointer to trap the write, so every one counts
+            dirty.set(address >> 8);
+            codeChanged(address >> 8);
+            memory[address] = value;
+        }
+
+        uint8_t read(uint16_t address) {
+            Page& page = pages[address >> 8];
+
+            if (page.read != nullptr) return page.read[address & 0xff];
+
+            for (Peripheral* peripheral: windows[address >> 8]) {
+                if ((uint16_t)(address - peripheral->start) <= 0xff) {
+                    deviceReads++;
+                    uint8_t value = peripheral->read((uint8_t)address);
+                    if (inputLog != nullptr) value = inputLog->deviceRead(value);
+                    return value;
+                }
+            }
+
+            return memory[address];
+        }
+
+        // Whether reads from the page have no side effects and change only on
+        // writes or device events: RAM, ROM and devices with steady reads
+        bool steady(uint8_t page) const {
+            if (pages[page].read != nullptr) return true;
+
+            return std::all_of(windows[page].begin(), windows[page].end(), [](const Peripheral* peripheral) {
+                return peripheral->steadyReads();
+            });
+        }
+
+    private:
+        // Host memory behind a writable RAM page, whether or not it is protected
+        uint8_t* ramPage(int page) {
+            if (pages[page].device != nullptr) return partial[page] ? &memory[page << 8] : nullptr;
+            if (pages[page].clean != nullptr) return pages[page].clean;
+            if (pages[page].write == romSink) return nullptr;
+            return pages[page].write;
+        }
+
+        // Whether the windows on a device page take up all of it
+        bool covered(int page) const {
+            std::bitset<0x100> bytes;
+            for (const Peripheral* peripheral: windows[page]) {
+                for (int offset = 0; offset < 0x100; offset++) {
+                    if ((uint16_t)((page << 8 | offset) - peripheral->start) <= 0xff) bytes.set(offset);
+                }
+            }
+            return bytes.all();
+        }
+
+        void codeChanged(int page) {
+            if (!codePages[page]) return;
+
+            codePages.reset(page);
+            if (codeCache != nullptr) codeCache->invalidate(page);
+        }
+
+        void protect(int page) {
+            if (pages[page].write == nullptr || pages[page].write == romSink) return;
+
+            pages[page].clean = pages[page].write;
+            pages[page].write = nullptr;
+        }
+};
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "loader.h"
+#include "snapshot.h"
+
+/*
+Checkpoint files: a Snapshot on disk, so a long run can be resumed after the
+host goes down. Layout, in host byte order:
+    CheckpointHeader
+    device states        deviceCount x (uint32 size, bytes)
+    padding              up to pagesOffset, a multiple of 256
+    page data            256 bytes for every page in the stored bitmap, in order
+Only RAM pages holding something other than zeros are stored.
+
+Files are written to a temporary name and renamed into place, so a crash
+mid-write leaves the previous checkpoint intact. Loading maps the file and
+the snapshot's pages point straight into the mapping, so nothing is read
+until Machine::restore() copies the pages in.
+*/
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+
+    uint64_t cycles;
+    uint64_t instructions;
+    uint32_t interrupts;
+    uint16_t pc;
+    uint8_t accumulator;
+    uint8_t x;
+    uint8_t y;
+    uint8_t sp;
+    uint8_t psr;
+    uint8_t instr_reg;
+
+    // Pages that were RAM, and which of those are stored (not all zero)
+    uint8_t ram[32];
+    uint8_t stored[32];
+
+    uint32_t deviceCount;
+    uint32_t deviceBytes;
+    uint64_t pagesOffset;
+};
+
+constexpr char CHECKPOINT_MAGIC[8] = {'6', '5', '0', '2', 'C', 'K', 'P', 'T'};
+constexpr uint32_t CHECKPOINT_VERSION = 1;
+
+inline bool writeCheckpoint(const Snapshot& snapshot, const std::string& path, std::string& error) {
+    CheckpointHeader header = {};
+    std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.headerSize = sizeof(CheckpointHeader);
+
+    header.cycles = snapshot.cycles;
+    header.instructions = snapshot.instructions;
+    header.interrupts = snapshot.interrupts;
+    header.pc = snapshot.pc;
+    header.accumulator = snapshot.accumulator;
+    header.x = snapshot.x;
+    header.y = snapshot.y;
+    header.sp = snapshot.sp;
+    header.psr = snapshot.psr;
+    header.instr_reg = snapshot.instr_reg;
+
+    static const PageData zeros = {};
+    for (int page = 0; page < 0x100; page++) {
+        if (snapshot.pages[page] == nullptr) continue;
+
+        header.ram[page >> 3] |= 1 << (page & 7);
+        if (*snapshot.pages[page] != zeros) header.stored[page >> 3] |= 1 << (page & 7);
+    }
+
+    header.deviceCount = snapshot.devices.size();
+    for (const auto& state: snapshot.devices) header.deviceBytes += sizeof(uint32_t) + state.size();
+
+    uint64_t end = sizeof(CheckpointHeader) + header.deviceBytes;
+    header.pagesOffset = (end + 0xff) & ~0xffull;
+
+    std::string temporary = path + ".tmp";
+    std::FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (file == nullptr) {
+        error = "cannot open " + temporary + " for writing";
+        return false;
+    }
+
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+
+    for (const auto& state: snapshot.devices) {
+        uint32_t size = state.size();
+        ok = ok && std::fwrite(&size, sizeof(size), 1, file) == 1;
+        ok = ok && std::fwrite(state.data(), 1, size, file) == size;
+    }
+
+    static const uint8_t padding[0x100] = {};
+    size_t padded = header.pagesOffset - end;
+    ok = ok && std::fwrite(padding, 1, padded, file) == padded;
+
+    for (int page = 0; page < 0x100; page++) {
+        if (header.stored[page >> 3] & (1 << (page & 7))) {
+            ok = ok && std::fwrite(snapshot.pages[page]->data(), 0x100, 1, file) == 1;
+        }
+    }
+
+    // On disk before it replaces the old checkpoint
+    ok = ok && std::fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = std::fclose(file) == 0 && ok;
+    ok = ok && std::rename(temporary.c_str(), path.c_str()) == 0;
+
+    if (!ok) {
+        std::remove(temporary.c_str());
+        error = "cannot write " + path;
+    }
+
+    return ok;
+}
+
+inline bool loadCheckpoint(const std::string& path, Snapshot& snapshot, std::string& error) {
+    auto file = std::make_shared<MappedFile>();
+    if (!file->open(path)) {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    const uint8_t* data = file->bytes();
+    size_t size = file->size();
+
+    CheckpointHeader header;
+    if (size < sizeof(header)) {
+        error = path + ": not a checkpoint";
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+
+    if (std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+        error = path + ": not a checkpoint";
+        return false;
+    }
+    if (header.version != CHECKPOINT_VERSION || header.headerSize != sizeof(CheckpointHeader)) {
+        error = path + ": unsupported checkpoint version " + std::to_string(header.version);
+        return false;
+    }
+
+    size_t storedPages = 0;
+    for (uint8_t bits: header.stored) storedPages += __builtin_popcount(bits);
+
+    if (header.pagesOffset < sizeof(header) + header.deviceBytes || header.pagesOffset > size ||
+        size - header.pagesOffset < storedPages * 0x100) {
+        error = path + ": truncated checkpoint";
+        return false;
+    }
+
+    snapshot.cycles = header.cycles;
+    snapshot.instructions = header.instructions;
+    snapshot.interrupts = header.interrupts;
+    snapshot.pc = header.pc;
+    snapshot.accumulator = header.accumulator;
+    snapshot.x = header.x;
+    snapshot.y = header.y;
+    snapshot.sp = header.sp;
+    snapshot.psr = header.psr;
+    snapshot.instr_reg = header.instr_reg;
+
+    snapshot.devices.clear();
+    size_t offset = sizeof(header);
+    size_t devicesEnd = offset + header.deviceBytes;
+    for (uint32_t i = 0; i < header.deviceCount; i++) {
+        uint32_t length;
+        if (devicesEnd - offset < sizeof(length)) {
+            error = path + ": bad device state";
+            return false;
+        }
+        std::memcpy(&length, data + offset, sizeof(length));
+        offset += sizeof(length);
+
+        if (devicesEnd - offset < length) {
+            error = path + ": bad device state";
+            return false;
+        }
+        snapshot.devices.emplace_back(data + offset, data + offset + length);
+        offset += length;
+    }
+
+    // Stored pages alias the mapping, which they keep alive
+    static const auto zeros = std::make_shared<const PageData>();
+    const uint8_t* pageData = data + header.pagesOffset;
+
+    for (int page = 0; page < 0x100; page++) {
+        if (header.stored[page >> 3] & (1 << (page & 7))) {
+            snapshot.pages[page] = std::shared_ptr<const PageData>(file, (const PageData*)pageData);
+            pageData += 0x100;
+        } else if (header.ram[page >> 3] & (1 << (page & 7))) {
+            snapshot.pages[page] = zeros;
+        } else {
+            snapshot.pages[page] = nullptr;
+        }
+    }
+
+    return true;
+}
+
+// Writes checkpoints on a background thread. The emulation thread only pays
+// for taking the snapshot: its pages are immutable and shared, so writing
+// them out needs no copy and no lock on the machine.
+class CheckpointWriter {
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable idle;
+
+    // Only the newest request is kept, if the disk falls behind older ones are skipped
+    std::unique_ptr<Snapshot> pending;
+    std::string pendingPath;
+    bool writing = false;
+    bool quit = false;
+
+    std::thread thread;
+
+    public:
+        CheckpointWriter() : thread([this] { work(); }) {}
+
+        CheckpointWriter(const CheckpointWriter&) = delete;
+        CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+        // A pending checkpoint is still written
+        ~CheckpointWriter() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                quit = true;
+            }
+            wake.notify_one();
+            thread.join();
+        }
+
+        void save(Snapshot snapshot, const std::string& path) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                pending = std::make_unique<Snapshot>(std::move(snapshot));
+                pendingPath = path;
+            }
+            wake.notify_one();
+        }
+
+        // Blocks until everything handed to save() is on disk
+        void wait() {
+            std::unique_lock<std::mutex> guard(lock);
+            idle.wait(guard, [this] { return pending == nullptr && !writing; });
+        }
+
+    private:
+        void work() {
+            std::unique_lock<std::mutex> guard(lock);
+
+            while (true) {
+                wake.wait(guard, [this] { return pending != nullptr || quit; });
+                if (pending == nullptr) return;
+
+                std::unique_ptr<Snapshot> snapshot = std::move(pending);
+                std::string path = pendingPath;
+                writing = true;
+
+                guard.unlock();
+                std::string error;
+                if (!writeCheckpoint(*snapshot, path, error)) std::fprintf(stderr, "%s\n", error.c_str());
+                snapshot.reset();
+                guard.lock();
+
+                writing = false;
+                idle.notify_all();
+            }
+        }
+};
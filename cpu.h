@@ -0,0 +1,1883 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "bus.h"
+#include "decimal.h"
+#include "interrupts.h"
+#include "jit.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "opcodes.h"
+#include "trace.h"
+#include "throttle.h"
+
+/* 
+Sources:
+    - https://ru.wikipedia.org/wiki/MOS_Technology_6502
+    - https://www.masswerk.at/6502/6502_instruction_set.html
+    - https://www.masswerk.at/6502/assembler.html
+*/
+
+enum {
+    CARRY_FLAG = 0x1,
+    ZERO_FLAG = 0x2,
+    INTERRUPT_FLAG = 0x4,
+    DECIMAL_FLAG = 0x8,
+    BREAK_FLAG = 0xf,
+    OVERFLOW_FLAG = 0x40,
+    NEGATIVE_FLAG = 0x80
+}; 
+
+enum {
+    IRQ = 0xffff,
+    RESET = 0xfffd,
+    NMI = 0xfffb
+};
+
+enum class StopReason {
+    BUDGET,             // cycle/instruction budget or deadline reached
+    BRK,                // BRK reached with stopOnBRK set, pc points at it
+    UNKNOWN_OPCODE,     // pc points at the opcode
+    BREAKPOINT,         // pc points at the breakpoint, not executed yet
+    HALT_LOOP,          // jump or branch to itself, or an idle loop with nothing to wait for, with stopOnHaltLoop set
+    STOPPED             // 65C02 STP, pc points at it
+};
+
+constexpr const char* stopReasonNames[] = {"budget", "brk", "unknown_opcode", "breakpoint", "halt_loop", "stopped"};
+
+struct RunResult {
+    StopReason reason;
+    uint64_t cycles;
+    uint64_t instructions;
+};
+
+template <typename Trace=NoTrace, Variant cpuVariant=Variant::NMOS>
+class CPU {
+    Bus& bus;
+
+    // Fixed per variant at compile time, nothing tests the variant while running
+    static constexpr bool cmos = cpuVariant == Variant::CMOS;
+    static constexpr bool hasDecimalMode = cpuVariant != Variant::RICOH_2A03;
+
+    // The run loop compares a single counter against this. Stopping sets it to 0.
+    uint64_t runLimit = 0;
+    StopReason stopReason = StopReason::BUDGET;
+
+    // The status register, kept so that setting N and Z is two stores: N is
+    // bit 7 of nValue, Z is set when zValue is 0, flags holds the other bits.
+    // getPSR() puts P together when something reads it.
+    uint8_t flags = 0;
+    uint8_t nValue = 0;
+    uint8_t zValue = 1;
+
+    std::bitset<0x10000> breakpoints;
+    size_t breakpointCount = 0;
+
+    // One handler per opcode, instantiated from the opcode table
+    using Handler = void (*)(CPU&);
+
+    // An instruction decoded once: handler, operand bytes and length
+    struct Decoded {
+        Handler handler = nullptr;
+        uint16_t operand = 0;
+        uint8_t opcode = 0;
+        uint8_t length = 0;
+    };
+
+    using DecodedPage = std::array<Decoded, 0x100>;
+
+    // One entry of a translated basic block: a single instruction or a fused
+    // run of two or three, with the operand bytes of each
+    struct Op;
+    using OpHandler = void (*)(CPU&, const Op&);
+
+    struct Op {
+        OpHandler handler;
+        uint16_t operands[3];
+    };
+
+    using Block = std::vector<Op>;
+    using BlockPage = std::array<std::unique_ptr<Block>, 0x100>;
+
+    // Blocks recompiled ahead of time, by address
+    using StaticPage = std::array<void (*)(CPU&), 0x100>;
+
+    // Per block start, whether the block is a loop skipIdle() may skip
+    enum IdleKind : uint8_t {IDLE_UNKNOWN, IDLE_NO, IDLE_YES};
+    using IdlePage = std::array<IdleKind, 0x100>;
+
+    // Filled lazily per 256-byte page. The bus write-protects pages with
+    // cached code and calls invalidate() on the first write to one.
+    struct DecodeCache : CodeCache {
+        std::array<std::unique_ptr<DecodedPage>, 0x100> pages;
+        std::array<std::unique_ptr<BlockPage>, 0x100> blocks;
+        std::array<std::unique_ptr<StaticPage>, 0x100> statics;
+        std::array<std::unique_ptr<IdlePage>, 0x100> idle;
+
+        // Blocks dropped while one of them may still be running, freed before the next
+        std::vector<std::unique_ptr<BlockPage>> retired;
+
+        // Set by any invalidation, a running block checks it after each instruction
+        bool changed = false;
+
+        // Compiled code from the same pages, when the JIT is on
+        CodeCache* native = nullptr;
+
+        void invalidate(uint8_t page) override {
+            if (pages[page] != nullptr) pages[page]->fill({});
+            if (blocks[page] != nullptr) retired.push_back(std::move(blocks[page]));
+            statics[page].reset();
+            idle[page].reset();
+            if (native != nullptr) native->invalidate(page);
+            changed = true;
+        }
+    };
+
+    DecodeCache decodeCache;
+
+    // Where the block loop last started a block, 0x10000 for nowhere, and
+    // whether that block is an idle loop once it is seen to repeat
+    uint32_t lastBlock = 0x10000;
+    IdleKind lastBlockIdle = IDLE_UNKNOWN;
+
+    // State at the start of the last iteration of a loop block
+    struct IdleWatch {
+        bool armed = false;
+        uint8_t a, x, y, sp, p;
+        uint64_t cycles;
+        uint64_t instructions;
+    };
+
+    IdleWatch idleWatch;
+
+    friend class Jit<CPU>;
+    std::unique_ptr<Jit<CPU>> jit;
+
+    public:
+        static constexpr Variant variant = cpuVariant;
+
+        // The opcode table of this variant, in place of the NMOS one
+        static constexpr const std::array<Opcode, 256>& opcodes = opcodeTable<cpuVariant>;
+
+        uint8_t accumulator = 0;
+        uint8_t x = 0, y = 0;
+        uint8_t sp = 0;
+
+        uint8_t instr_reg = 0;
+
+        // Operand bytes of the current instruction, absolute operands high byte first
+        uint16_t fetched = 0;
+
+        uint16_t pc = 0;
+
+        uint64_t cycles = 0;
+        uint64_t instructions = 0;
+
+        bool stopOnBRK = false;
+        bool stopOnHaltLoop = false;
+
+        // Devices on any thread assert IRQ/NMI here
+        InterruptLines interrupts;
+
+        // Device events, timed in CPU cycles
+        Scheduler scheduler{cycles};
+
+        // Records or replays the interrupts taken, when set
+        InputLog* inputLog = nullptr;
+
+        Trace trace;
+
+        template <typename... Args>
+        explicit CPU(Bus& bus, Args&&... args) : bus(bus), trace(std::forward<Args>(args)...) {
+            bus.codeCache = &decodeCache;
+        }
+
+        uint8_t read(uint16_t address) {
+            return bus.read(address);
+        }
+
+        void write(uint16_t address, uint8_t value) {
+            bus.write(address, value);
+        }
+
+        void pushStack(uint8_t data) {
+            write(((uint16_t)0x01 << 8) | sp, data);
+            sp--;
+        }
+
+        uint8_t pullStack() {
+            sp++;
+            return read(((uint16_t)0x01 << 8) | sp);
+        }
+
+        void pushPC() {
+            uint8_t high = pc >> 8;
+            uint8_t low = pc;
+
+            pushStack(high);
+            pushStack(low);
+        }
+
+        uint16_t pullPC() {
+            uint8_t low = pullStack();
+            uint8_t high = pullStack();
+
+            return ((uint16_t)high << 8) | low;
+        }
+
+        void reset() {
+            pc = ((uint16_t)read(RESET) << 8) | read(RESET-1);
+        }
+
+        uint16_t absoluteAddress() {
+            return fetched;
+        }
+
+        uint8_t immediateValue() {
+            return fetched;
+        }
+
+        uint8_t relativeValue() {
+            return fetched;
+        }
+
+        uint16_t absoluteIndexedY() {
+            return absoluteAddress()+y;
+        }
+
+        uint16_t absoluteIndexedX() {
+            return absoluteAddress()+x;
+        }
+        
+        uint16_t indirectAbsoluteAddress() {
+            uint8_t low = read(fetched);
+            uint16_t high = read(fetched+1) << 8;
+            return high | low;
+        }
+
+        uint16_t indirectIndexedAddress() {
+            uint8_t zeroPage = fetched;
+            uint8_t low = read(zeroPage);
+            uint8_t high = read((uint8_t)(zeroPage+1));
+            uint16_t address = ((uint16_t)high << 8) | low;
+            return address+y;
+        }
+
+        uint16_t indexedIndirectAddress() {
+            uint8_t zeroPage = fetched + x;
+            uint8_t low = read(zeroPage);
+            uint8_t high = read((uint8_t)(zeroPage+1));
+
+            return ((uint16_t)high << 8) | low;
+        }
+
+        uint16_t zeroPageIndirectAddress() {
+            uint8_t zeroPage = fetched;
+            uint8_t low = read(zeroPage);
+            uint8_t high = read((uint8_t)(zeroPage+1));
+            return ((uint16_t)high << 8) | low;
+        }
+
+        uint16_t absoluteIndexedIndirectAddress() {
+            uint16_t pointer = fetched + x;
+            uint8_t low = read(pointer);
+            uint16_t high = read(pointer+1) << 8;
+            return high | low;
+        }
+
+        uint16_t zeroPagedIndexedXAddress() {
+            return (uint8_t)(fetched+x);
+        }
+
+        uint16_t zeroPagedIndexedYAddress() {
+            return (uint8_t)(fetched+y);
+        }
+
+        uint8_t zeroPagedAddress() {
+            return fetched;
+        }
+        
+        // Taken branches cost one extra cycle, two when the target is on another page
+        void branch(bool taken, uint8_t operand, uint8_t length=2) {
+            if (!taken) {
+                pc += length;
+                return;
+            }
+
+            if (stopOnHaltLoop && operand == 0) stop(StopReason::HALT_LOOP);
+
+            uint16_t next = pc + length;
+            pc += (int8_t)operand;
+
+            cycles += 1 + ((next ^ pc) > 0xff);
+        }
+
+        void executeIRQ() {
+            cycles += 7;
+
+            pushPC();
+            pushStack(getPSR());
+
+            pc = ((uint16_t)read(IRQ) << 8) | read(IRQ-1);
+
+            setFlag(INTERRUPT_FLAG);
+            if constexpr (cmos) unsetFlag(DECIMAL_FLAG);
+        }
+
+        void executeNMI() {
+            cycles += 7;
+
+            pushPC();
+            pushStack(getPSR());
+
+            pc = ((uint16_t)read(NMI) << 8) | read(NMI-1);
+
+            setFlag(INTERRUPT_FLAG);
+            if constexpr (cmos) unsetFlag(DECIMAL_FLAG);
+        }
+
+        // NMI wins over IRQ, IRQ waits while the interrupt flag is set.
+        // True if one was taken.
+        bool serviceInterrupts() {
+            // A replayed run takes the interrupts in its log instead
+            if (inputLog != nullptr && inputLog->replaying()) return false;
+
+            if (interrupts.takeNMI()) {
+                if (inputLog != nullptr) inputLog->interrupt(InputLog::NMI);
+                executeNMI();
+                return true;
+            }
+
+            if (interrupts.irq() && !checkFlag(INTERRUPT_FLAG)) {
+                if (inputLog != nullptr) inputLog->interrupt(InputLog::IRQ);
+                executeIRQ();
+                return true;
+            }
+
+            return false;
+        }
+
+        uint8_t getPSR() const {
+            return flags | (nValue & NEGATIVE_FLAG) | (zValue == 0 ? ZERO_FLAG : 0);
+        }
+
+        void setPSR(uint8_t value) {
+            flags = value & ~(NEGATIVE_FLAG | ZERO_FLAG);
+            nValue = value;
+            zValue = ~value & ZERO_FLAG;
+        }
+
+        void setFlag(uint8_t flag) {
+            flags |= flag & ~(NEGATIVE_FLAG | ZERO_FLAG);
+            if (flag & NEGATIVE_FLAG) nValue = 0x80;
+            if (flag & ZERO_FLAG) zValue = 0;
+        }
+
+        void unsetFlag(uint8_t flag) {
+            flags &= ~flag;
+            if (flag & NEGATIVE_FLAG) nValue = 0;
+            if (flag & ZERO_FLAG) zValue = 1;
+        }
+
+        bool checkFlag(uint8_t flag) const {
+            return ((getPSR() & flag) > 0);
+        }
+
+        // N and Z from a result
+        void setNZ(uint8_t value) {
+            nValue = zValue = value;
+        }
+
+        void setN(uint8_t value) {
+            nValue = value;
+        }
+
+        void setZ(uint8_t value) {
+            zValue = value;
+        }
+
+        void setCarry(bool set) {
+            flags = (flags & ~CARRY_FLAG) | (set ? CARRY_FLAG : 0);
+        }
+
+        void setOverflow(bool set) {
+            flags = (flags & ~OVERFLOW_FLAG) | (set ? OVERFLOW_FLAG : 0);
+        }
+
+        // Read-modify-write as the 6502 does it on the bus: one read, the old
+        // value written back while the ALU works (read again on the 65C02),
+        // then the result
+        template <uint8_t (CPU::*modify)(uint8_t)>
+        uint8_t readModifyWrite(uint16_t address) {
+            uint8_t value = read(address);
+            if constexpr (cmos) read(address);
+            else write(address, value);
+
+            value = (this->*modify)(value);
+            write(address, value);
+            return value;
+        }
+
+        uint8_t shiftLeft(uint8_t value) {
+            setCarry((value & 0x80) != 0);
+            value <<= 1;
+            setNZ(value);
+            return value;
+        }
+
+        uint8_t shiftRight(uint8_t value) {
+            setCarry((value & 0x01) != 0);
+            value >>= 1;
+            setNZ(value);
+            return value;
+        }
+
+        uint8_t rotateLeft(uint8_t value) {
+            uint8_t carry = checkFlag(CARRY_FLAG) ? 0x01 : 0;
+            setCarry((value & 0x80) != 0);
+            value = (value << 1) | carry;
+            setNZ(value);
+            return value;
+        }
+
+        uint8_t rotateRight(uint8_t value) {
+            uint8_t carry = checkFlag(CARRY_FLAG) ? 0x80 : 0;
+            setCarry((value & 0x01) != 0);
+            value = (value >> 1) | carry;
+            setNZ(value);
+            return value;
+        }
+
+        uint8_t increment(uint8_t value) {
+            setNZ(++value);
+            return value;
+        }
+
+        uint8_t decrement(uint8_t value) {
+            setNZ(--value);
+            return value;
+        }
+
+        uint8_t testAndReset(uint8_t value) {
+            setZ(accumulator & value);
+            return value & ~accumulator;
+        }
+
+        uint8_t testAndSet(uint8_t value) {
+            setZ(accumulator & value);
+            return value | accumulator;
+        }
+
+        template <uint8_t bit>
+        uint8_t resetBit(uint8_t value) {
+            return value & ~bit;
+        }
+
+        template <uint8_t bit>
+        uint8_t setBit(uint8_t value) {
+            return value | bit;
+        }
+
+        // A and all four result flags from a decimal-mode ADC or SBC, which
+        // takes the 65C02 a cycle longer
+        template <DecimalOperation operation>
+        void decimal(uint8_t operand, bool carry) {
+#if DECIMAL_TABLES
+            DecimalResult result = decimalTable<operation>[carry << 16 | accumulator << 8 | operand];
+#else
+            DecimalResult result = operation(accumulator, operand, carry);
+#endif
+            accumulator = result.value;
+            flags = (flags & ~(CARRY_FLAG | OVERFLOW_FLAG)) | (result.flags & (CARRY_FLAG | OVERFLOW_FLAG));
+            nValue = result.flags;
+            zValue = ~result.flags & ZERO_FLAG;
+
+            if constexpr (cmos) cycles++;
+        }
+
+        RunResult run() {
+            reset();
+
+            return runCycles(UINT64_MAX);
+        }
+
+        RunResult run(Throttle& throttle) {
+            reset();
+
+            return runPaced(throttle);
+        }
+
+        // Runs in batches from the current state, letting the throttle pace
+        // each batch against the wall clock
+        RunResult runPaced(Throttle& throttle) {
+            uint64_t batch = throttle.batchCycles();
+            uint64_t startCycles = cycles;
+            uint64_t startInstructions = instructions;
+            throttle.start(cycles);
+
+            RunResult result;
+            while ((result = runCycles(batch)).reason == StopReason::BUDGET) {
+                throttle.pace(cycles);
+            }
+
+            return {result.reason, cycles - startCycles, instructions - startInstructions};
+        }
+
+        // Bounded runs resume from the current state, call reset() first to start over.
+        // Budgets may be overshot by the remainder of the last instruction.
+        RunResult runCycles(uint64_t budget) {
+            return runFor<false>(budget);
+        }
+
+        RunResult runInstructions(uint64_t budget) {
+            return runFor<true>(budget);
+        }
+
+        RunResult runUntil(std::chrono::steady_clock::time_point deadline, uint64_t sliceCycles=10000) {
+            RunResult result = {StopReason::BUDGET, 0, 0};
+
+            while (std::chrono::steady_clock::now() < deadline) {
+                RunResult slice = runCycles(sliceCycles);
+
+                result.reason = slice.reason;
+                result.cycles += slice.cycles;
+                result.instructions += slice.instructions;
+
+                if (slice.reason != StopReason::BUDGET) break;
+            }
+
+            return result;
+        }
+
+        void stop(StopReason reason) {
+            stopReason = reason;
+            runLimit = 0;
+        }
+
+        void addBreakpoint(uint16_t address) {
+            if (!breakpoints[address]) breakpointCount++;
+            breakpoints[address] = true;
+        }
+
+        void removeBreakpoint(uint16_t address) {
+            if (breakpoints[address]) breakpointCount--;
+            breakpoints[address] = false;
+        }
+
+        bool isBreakpoint(uint16_t address) const {
+            return breakpoints[address];
+        }
+
+        // Compiles hot blocks to native code for cycle-budget runs without
+        // breakpoints or tracing. False where the host cannot run it.
+        // Switch it on or off between runs, not from inside one.
+        bool enableJit(bool perfMap=false) {
+#if defined(__x86_64__)
+            if (jit == nullptr) {
+                jit = std::make_unique<Jit<CPU>>(*this, perfMap);
+                if (!jit->available()) {
+                    jit.reset();
+                    return false;
+                }
+                decodeCache.native = jit.get();
+            }
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        void disableJit() {
+            decodeCache.native = nullptr;
+            jit.reset();
+        }
+
+        bool jitEnabled() const {
+            return jit != nullptr;
+        }
+
+        // A basic block recompiled ahead of time (see recompiler.h), valid
+        // while memory at address holds bytes
+        struct StaticBlock {
+            uint16_t address;
+            uint16_t length;
+            const uint8_t* bytes;
+            void (*run)(CPU&);
+        };
+
+        // Takes the blocks whose bytes are in memory now, returns how many.
+        // Like the other code caches they are dropped for good once their page is written.
+        size_t addStaticCode(const StaticBlock* blocks, size_t count) {
+            size_t installed = 0;
+
+            for (size_t i = 0; i < count; i++) {
+                const StaticBlock& block = blocks[i];
+                const uint8_t* host = bus.pages[block.address >> 8].read;
+                unsigned offset = block.address & 0xff;
+
+                if (host == nullptr || offset + block.length > 0x100) continue;
+                if (std::memcmp(host + offset, block.bytes, block.length) != 0) continue;
+
+                auto& page = decodeCache.statics[block.address >> 8];
+                if (page == nullptr) page = std::make_unique<StaticPage>();
+                bus.watchCode(block.address >> 8);
+
+                (*page)[offset] = block.run;
+                installed++;
+            }
+
+            return installed;
+        }
+
+        // One instruction with its operand bytes known in advance, for recompiled code
+        template <uint8_t code>
+        void executeDecoded(uint16_t operand) {
+            instr_reg = code;
+            fetched = operand;
+            handler<code, false>(*this);
+        }
+
+        template <bool countInstructions>
+        RunResult runFor(uint64_t budget) {
+            uint64_t startCycles = cycles;
+            uint64_t startInstructions = instructions;
+            uint64_t start = countInstructions ? instructions : cycles;
+            uint64_t end = budget > UINT64_MAX - start ? UINT64_MAX : start + budget;
+
+            stopReason = StopReason::BUDGET;
+
+            if constexpr (countInstructions) {
+                // Event timestamps are cycles, the loop checks them per instruction
+                runLimit = end;
+                loop<true>();
+            } else {
+                // Run flat out up to the next event, dispatch it, repeat.
+                // Events scheduled meanwhile pull runLimit in through the deadline pointer.
+                scheduler.deadline = &runLimit;
+
+                while (stopReason == StopReason::BUDGET && cycles < end) {
+                    runLimit = std::min(end, scheduler.next());
+                    loop<false>();
+                    scheduler.runDue();
+                }
+
+                // An interrupt the last events raised is taken now, not at the start
+                // of the next run, the same as a replayed one at this cycle would be
+                if (stopReason == StopReason::BUDGET && interrupts.any()) serviceInterrupts();
+
+                scheduler.deadline = nullptr;
+            }
+
+            if (stopReason != StopReason::BUDGET) trace.flush();
+
+            return {stopReason, cycles - startCycles, instructions - startInstructions};
+        }
+
+        template <bool countInstructions>
+        void loop() {
+            if (breakpointCount > 0) loop<countInstructions, true>();
+            else loop<countInstructions, false>();
+        }
+
+        template <bool countInstructions, bool checkBreakpoints>
+        void loop() {
+            const uint64_t& counter = countInstructions ? instructions : cycles;
+
+            // Plain cycle-budget runs go block by block, anything else one instruction at a time
+            constexpr bool blocks = !countInstructions && !checkBreakpoints && !Trace::enabled;
+
+            // Events may have changed memory since the loop last ran
+            lastBlock = 0x10000;
+
+            while (counter < runLimit) {
+                if constexpr (countInstructions) {
+                    if (cycles >= scheduler.next()) scheduler.runDue();
+                }
+
+                // The entry takes cycles, so back to the top: the events due by its end
+                // run before the handler, and a run that reached its limit ends there.
+                // A replayed interrupt, taken from a scheduled event, lands the same way.
+                if (interrupts.any() && serviceInterrupts()) continue;
+
+                if constexpr (blocks) {
+                    if (pc == lastBlock) {
+                        if (lastBlockIdle == IDLE_UNKNOWN) lastBlockIdle = idleLoop(pc) ? IDLE_YES : IDLE_NO;
+
+                        if (lastBlockIdle == IDLE_YES) {
+                            skipIdle();
+                            if (counter >= runLimit) break;
+                        }
+                    } else {
+                        lastBlock = pc;
+                        lastBlockIdle = IDLE_UNKNOWN;
+                        idleWatch.armed = false;
+                    }
+
+                    if (!runStatic()) {
+                        if (jit != nullptr) runNative();
+                        else runBlock();
+                    }
+                } else {
+                    step();
+                }
+
+                // Checked after the instruction so resuming from a breakpoint makes progress
+                if constexpr (checkBreakpoints) {
+                    if (breakpoints[pc]) stop(StopReason::BREAKPOINT);
+                }
+            }
+        }
+
+        // Runs one instruction, predecoded when the cache has it
+        void step() {
+            auto& page = decodeCache.pages[pc >> 8];
+            if (page != nullptr && (*page)[pc & 0xff].handler != nullptr) {
+                const Decoded& entry = (*page)[pc & 0xff];
+                instr_reg = entry.opcode;
+                fetched = entry.operand;
+                dispatch(entry.handler);
+                return;
+            }
+
+            // Only instructions wholly inside a RAM or ROM page are cached,
+            // device reads may have side effects
+            const uint8_t* host = bus.pages[pc >> 8].read;
+            if (host == nullptr || (pc & 0xff) + opcodes[host[pc & 0xff]].length > 0x100) {
+                instr_reg = read(pc);
+                dispatch(handlers[instr_reg]);
+                return;
+            }
+
+            if (page == nullptr) page = std::make_unique<DecodedPage>();
+            bus.watchCode(pc >> 8);
+
+            Decoded& entry = (*page)[pc & 0xff];
+            entry.opcode = host[pc & 0xff];
+            entry.length = opcodes[entry.opcode].length;
+            entry.operand = 0;
+            if (entry.length == 2) entry.operand = host[(pc & 0xff) + 1];
+            if (entry.length == 3) entry.operand = (uint16_t)host[(pc & 0xff) + 1] << 8 | host[(pc & 0xff) + 2];
+            entry.handler = decodedHandlers[entry.opcode];
+
+            instr_reg = entry.opcode;
+            fetched = entry.operand;
+            dispatch(entry.handler);
+        }
+
+        void dispatch(Handler handler) {
+            if constexpr (Trace::enabled) {
+                trace.record({cycles, pc, instr_reg, accumulator, x, y, sp, getPSR(), cpuVariant});
+            }
+
+            handler(*this);
+        }
+
+        // Runs the translated block at pc. Between instructions it stops where the
+        // instruction loop would look at something: the run limit (budget, stop,
+        // next event) or a pending interrupt, and when the block's code changed.
+        void runBlock() {
+            if (!decodeCache.retired.empty()) decodeCache.retired.clear();
+
+            auto& page = decodeCache.blocks[pc >> 8];
+            const Block* block = page != nullptr ? (*page)[pc & 0xff].get() : nullptr;
+
+            if (block == nullptr) {
+                block = translate();
+                if (block == nullptr) {
+                    step();
+                    return;
+                }
+            }
+
+            decodeCache.changed = false;
+            for (const Op& op: *block) {
+                op.handler(*this, op);
+                if (blockExit()) return;
+            }
+        }
+
+        // Runs the recompiled block at pc, false if there is none
+        bool runStatic() {
+            const auto& page = decodeCache.statics[pc >> 8];
+            if (page == nullptr) return false;
+
+            auto run = (*page)[pc & 0xff];
+            if (run == nullptr) return false;
+
+            decodeCache.changed = false;
+            run(*this);
+            return true;
+        }
+
+        // Compiled code for the block at pc, or the block interpreter until there is some
+        void runNative() {
+            auto code = jit->lookup(pc);
+            if (code == nullptr) {
+                runBlock();
+                return;
+            }
+
+            decodeCache.changed = false;
+            code(this);
+        }
+
+        bool blockExit() const {
+            return cycles >= runLimit || interrupts.any() || decodeCache.changed;
+        }
+
+        // Called when an idle loop block at pc starts again right after itself.
+        // A loop that only reads memory nothing but an event can change, and
+        // comes round to the same registers, repeats unchanged until the next
+        // event or interrupt: skip whole iterations up to it, counting their
+        // cycles and instructions, and leave the last one to run as usual.
+        void skipIdle() {
+            uint8_t p = getPSR();
+            IdleWatch& watch = idleWatch;
+
+            if (!watch.armed || watch.a != accumulator || watch.x != x || watch.y != y || watch.sp != sp || watch.p != p) {
+                watch = {true, accumulator, x, y, sp, p, cycles, instructions};
+                return;
+            }
+
+            // A masked IRQ keeps the lines busy without ending the loop
+            if (interrupts.any()) return;
+
+            if (stopOnHaltLoop && scheduler.empty()) {
+                stop(StopReason::HALT_LOOP);
+                return;
+            }
+
+            // With no event and no budget only another thread can end the loop
+            if (runLimit == UINT64_MAX) return;
+
+            uint64_t period = cycles - watch.cycles;
+            uint64_t skipped = (runLimit - cycles - 1) / period;
+
+            cycles += skipped * period;
+            instructions += skipped * (instructions - watch.instructions);
+
+            watch.cycles = cycles;
+            watch.instructions = instructions;
+        }
+
+        // Whether the block at address is a loop to itself that reads only
+        // RAM, ROM and devices with steady reads, and writes nothing
+        bool idleLoop(uint16_t address) {
+            const auto& page = decodeCache.idle[address >> 8];
+            if (page != nullptr && (*page)[address & 0xff] != IDLE_UNKNOWN) return (*page)[address & 0xff] == IDLE_YES;
+
+            return classifyIdle(address);
+        }
+
+        bool classifyIdle(uint16_t address) {
+            auto& page = decodeCache.idle[address >> 8];
+            const uint8_t* host = bus.pages[address >> 8].read;
+            if (host == nullptr) return false;
+
+            if (page == nullptr) page = std::make_unique<IdlePage>();
+            bus.watchCode(address >> 8);
+
+            bool idle = false;
+            unsigned offset = address & 0xff;
+            for (size_t count = 0; count < MAX_BLOCK && offset < 0x100; count++) {
+                const Opcode& opcode = opcodes[host[offset]];
+                if (offset + opcode.length > 0x100) break;
+
+                uint16_t operand = 0;
+                if (opcode.length == 2) operand = host[offset + 1];
+                if (opcode.length == 3) operand = (uint16_t)host[offset + 1] << 8 | host[offset + 2];
+
+                if (!idleInstruction(opcode, operand)) break;
+
+                if (changesPC(opcode.instruction)) {
+                    uint16_t at = (address & 0xff00) | offset;
+                    idle = loopsTo(opcode, operand, at, address);
+                    break;
+                }
+
+                offset += opcode.length;
+            }
+
+            (*page)[address & 0xff] = idle ? IDLE_YES : IDLE_NO;
+            return idle;
+        }
+
+        // Reads into registers and flags, tests and jumps, at addresses
+        // known from the operand alone
+        bool idleInstruction(const Opcode& opcode, uint16_t operand) const {
+            using I = Instruction;
+
+            switch (opcode.instruction) {
+                case I::LDA: case I::LDX: case I::LDY:
+                case I::AND: case I::ORA: case I::EOR: case I::BIT:
+                case I::CMP: case I::CPX: case I::CPY:
+                    break;
+                case I::NOP:
+                case I::CLC: case I::SEC: case I::CLV:
+                case I::BCC: case I::BCS: case I::BEQ: case I::BMI:
+                case I::BNE: case I::BPL: case I::BVC: case I::BVS:
+                case I::BRA:
+                    return opcode.mode == IMPLIED || opcode.mode == RELATIVE || opcode.mode == IMMEDIATE;
+                case I::JMP:
+                    return opcode.mode == ABSOLUTE;
+                case I::BBR: case I::BBS:
+                    return bus.steady(0);
+                default:
+                    return false;
+            }
+
+            switch (opcode.mode) {
+                case IMMEDIATE:
+                    return true;
+                case ZERO_PAGE: case ZERO_PAGE_X: case ZERO_PAGE_Y:
+                    return bus.steady(0);
+                case ABSOLUTE:
+                    return bus.steady(operand >> 8);
+                case ABSOLUTE_X: case ABSOLUTE_Y:
+                    // Either page, depending on the index
+                    return bus.steady(operand >> 8) && bus.steady((uint8_t)((operand >> 8) + 1));
+                default:
+                    return false;
+            }
+        }
+
+        static bool loopsTo(const Opcode& opcode, uint16_t operand, uint16_t at, uint16_t start) {
+            using I = Instruction;
+
+            switch (opcode.instruction) {
+                case I::JMP:
+                    return operand == start;
+                case I::BBR: case I::BBS:
+                    return (uint16_t)(at + (int8_t)(operand & 0xff)) == start;
+                default:
+                    // Relative to the branch's own address, like branch()
+                    return (uint16_t)(at + (int8_t)operand) == start;
+            }
+        }
+
+        static constexpr size_t MAX_BLOCK = 32;
+
+        // Decodes the basic block starting at pc: up to and including the first
+        // instruction that changes pc, ending early at the page boundary.
+        // Null when pc is not on a RAM or ROM page.
+        const Block* translate() {
+            const uint8_t* host = bus.pages[pc >> 8].read;
+            if (host == nullptr) return nullptr;
+
+            uint8_t codes[MAX_BLOCK];
+            uint16_t operands[MAX_BLOCK];
+            size_t count = 0;
+
+            unsigned offset = pc & 0xff;
+            while (count < MAX_BLOCK) {
+                const Opcode& opcode = opcodes[host[offset]];
+                if (offset + opcode.length > 0x100) break;
+
+                codes[count] = host[offset];
+                operands[count] = 0;
+                if (opcode.length == 2) operands[count] = host[offset + 1];
+                if (opcode.length == 3) operands[count] = (uint16_t)host[offset + 1] << 8 | host[offset + 2];
+                count++;
+
+                offset += opcode.length;
+                if (changesPC(opcode.instruction) || offset >= 0x100) break;
+            }
+
+            // First instruction spills into the next page
+            if (count == 0) return nullptr;
+
+            auto block = std::make_unique<Block>();
+            for (size_t i = 0; i < count;) {
+                size_t length = 1;
+                OpHandler handler = singleHandlers[codes[i]];
+
+                if (i + 2 < count && tripleHandler(codes[i], codes[i + 1], codes[i + 2]) != nullptr) {
+                    handler = tripleHandler(codes[i], codes[i + 1], codes[i + 2]);
+                    length = 3;
+                } else if (i + 1 < count && pairHandler(codes[i], codes[i + 1]) != nullptr) {
+                    handler = pairHandler(codes[i], codes[i + 1]);
+                    length = 2;
+                }
+
+                Op op = {handler, {0, 0, 0}};
+                for (size_t j = 0; j < length; j++) op.operands[j] = operands[i + j];
+                block->push_back(op);
+
+                i += length;
+            }
+
+            auto& page = decodeCache.blocks[pc >> 8];
+            if (page == nullptr) page = std::make_unique<BlockPage>();
+            bus.watchCode(pc >> 8);
+
+            (*page)[pc & 0xff] = std::move(block);
+            return (*page)[pc & 0xff].get();
+        }
+
+        // Instructions whose only flag effect is N and Z from one register, and
+        // instructions that set N and Z without reading them. In a fused run the
+        // first kind skips its flags when the next is of the second kind.
+        static constexpr bool setsOnlyNZ(Instruction instruction) {
+            using I = Instruction;
+            switch (instruction) {
+                case I::INX: case I::INY: case I::DEX: case I::DEY:
+                case I::LDA: case I::LDX: case I::LDY:
+                case I::TAX: case I::TAY: case I::TXA: case I::TYA:
+                case I::AND: case I::ORA: case I::EOR:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        static constexpr bool overwritesNZ(Instruction instruction) {
+            return setsOnlyNZ(instruction) || instruction == Instruction::CMP ||
+                instruction == Instruction::CPX || instruction == Instruction::CPY;
+        }
+
+        // execute() of a setsOnlyNZ instruction without the flags
+        template <Instruction instruction, AddressingMode mode>
+        void executeWithoutFlags() {
+            using I = Instruction;
+
+            if constexpr (instruction == I::INX) x++;
+            else if constexpr (instruction == I::INY) y++;
+            else if constexpr (instruction == I::DEX) x--;
+            else if constexpr (instruction == I::DEY) y--;
+            else if constexpr (instruction == I::LDA) accumulator = operand<mode>();
+            else if constexpr (instruction == I::LDX) x = operand<mode>();
+            else if constexpr (instruction == I::LDY) y = operand<mode>();
+            else if constexpr (instruction == I::TAX) x = accumulator;
+            else if constexpr (instruction == I::TAY) y = accumulator;
+            else if constexpr (instruction == I::TXA) accumulator = x;
+            else if constexpr (instruction == I::TYA) accumulator = y;
+            else if constexpr (instruction == I::AND) accumulator &= operand<mode>();
+            else if constexpr (instruction == I::ORA) accumulator |= operand<mode>();
+            else if constexpr (instruction == I::EOR) accumulator ^= operand<mode>();
+
+            pc += modeLength(mode);
+        }
+
+        // The register a setsOnlyNZ instruction takes N and Z from
+        template <Instruction instruction>
+        uint8_t flagSource() const {
+            using I = Instruction;
+
+            if constexpr (instruction == I::INX || instruction == I::DEX || instruction == I::LDX || instruction == I::TAX) return x;
+            else if constexpr (instruction == I::INY || instruction == I::DEY || instruction == I::LDY || instruction == I::TAY) return y;
+            else return accumulator;
+        }
+
+        template <uint8_t code>
+        static void single(CPU& cpu, const Op& op) {
+            cpu.instr_reg = code;
+            cpu.fetched = op.operands[0];
+            handler<code, false>(cpu);
+        }
+
+        // Runs instructions index.. of a fused op, stopping between them like runBlock()
+        template <size_t index, uint8_t code, uint8_t... rest>
+        static void fused(CPU& cpu, const Op& op) {
+            constexpr Opcode opcode = opcodes[code];
+
+            cpu.instr_reg = code;
+            cpu.fetched = op.operands[index];
+
+            if constexpr (sizeof...(rest) == 0) {
+                handler<code, false>(cpu);
+            } else {
+                constexpr uint8_t next[] = {rest...};
+                constexpr bool elide = setsOnlyNZ(opcode.instruction) && overwritesNZ(opcodes[next[0]].instruction);
+
+                if constexpr (elide) {
+                    cpu.template executeWithoutFlags<opcode.instruction, opcode.mode>();
+                    cpu.cycles += opcode.cycles;
+                    cpu.instructions++;
+                } else {
+                    handler<code, false>(cpu);
+                }
+
+                if (cpu.blockExit()) {
+                    // Stopping here after all, the skipped flags are needed
+                    if constexpr (elide) cpu.setNZ(cpu.template flagSource<opcode.instruction>());
+                    return;
+                }
+
+                fused<index + 1, rest...>(cpu, op);
+            }
+        }
+
+        // Opcodes common in tight loops, any two of them in a row are fused
+        static constexpr uint8_t pairCodes[] = {
+            0xa9, 0xa5, 0xb5, 0xad, 0xbd, 0xb9, 0xb1,     // LDA #, zp, zp,X, abs, abs,X, abs,Y, (zp),Y
+            0xa2, 0xa0,                                     // LDX #, LDY #
+            0x85, 0x95, 0x8d, 0x9d, 0x99, 0x91,             // STA zp, zp,X, abs, abs,X, abs,Y, (zp),Y
+            0xe8, 0xc8, 0xca, 0x88,                         // INX, INY, DEX, DEY
+            0xaa, 0x8a,                                     // TAX, TXA
+            0xc9, 0xe0, 0xc0,                               // CMP #, CPX #, CPY #
+            0xd0, 0xf0, 0x4c                                // BNE, BEQ, JMP
+        };
+
+        // Count, compare and branch: the classic loop tail
+        static constexpr uint8_t tripleFirst[] = {0xe8, 0xc8, 0xca, 0x88};
+        static constexpr uint8_t tripleSecond[] = {0xe0, 0xc0, 0xc9};
+        static constexpr uint8_t tripleThird[] = {0xd0, 0xf0, 0x90, 0xb0};
+
+        static constexpr size_t PAIR_CODES = sizeof(pairCodes);
+        static constexpr size_t TRIPLE_SECOND = sizeof(tripleSecond);
+        static constexpr size_t TRIPLE_THIRD = sizeof(tripleThird);
+
+        template <size_t... indexes>
+        static constexpr std::array<OpHandler, sizeof...(indexes)> makePairHandlers(std::index_sequence<indexes...>) {
+            return {{&fused<0, pairCodes[indexes / PAIR_CODES], pairCodes[indexes % PAIR_CODES]>...}};
+        }
+
+        template <size_t... indexes>
+        static constexpr std::array<OpHandler, sizeof...(indexes)> makeTripleHandlers(std::index_sequence<indexes...>) {
+            return {{&fused<0, tripleFirst[indexes / (TRIPLE_SECOND * TRIPLE_THIRD)],
+                tripleSecond[indexes / TRIPLE_THIRD % TRIPLE_SECOND], tripleThird[indexes % TRIPLE_THIRD]>...}};
+        }
+
+        template <size_t... codes>
+        static constexpr std::array<OpHandler, 256> makeSingleHandlers(std::index_sequence<codes...>) {
+            return {{&single<codes>...}};
+        }
+
+        template <size_t size>
+        static constexpr int indexOf(const uint8_t (&codes)[size], uint8_t code) {
+            for (size_t i = 0; i < size; i++) {
+                if (codes[i] == code) return i;
+            }
+            return -1;
+        }
+
+        static OpHandler pairHandler(uint8_t first, uint8_t second) {
+            // Nothing follows an instruction that changes pc within a block
+            if (changesPC(opcodes[first].instruction)) return nullptr;
+
+            int i = indexOf(pairCodes, first), j = indexOf(pairCodes, second);
+            if (i < 0 || j < 0) return nullptr;
+
+            return pairHandlers[i * PAIR_CODES + j];
+        }
+
+        static OpHandler tripleHandler(uint8_t first, uint8_t second, uint8_t third) {
+            int i = indexOf(tripleFirst, first), j = indexOf(tripleSecond, second), k = indexOf(tripleThird, third);
+            if (i < 0 || j < 0 || k < 0) return nullptr;
+
+            return tripleHandlers[(i * TRIPLE_SECOND + j) * TRIPLE_THIRD + k];
+        }
+
+        static const std::array<OpHandler, 256> singleHandlers;
+        static const std::array<OpHandler, PAIR_CODES * PAIR_CODES> pairHandlers;
+        static const std::array<OpHandler, sizeof(tripleFirst) * TRIPLE_SECOND * TRIPLE_THIRD> tripleHandlers;
+
+        // Operand bytes for an instruction run without the cache
+        template <AddressingMode mode>
+        void fetch() {
+            if constexpr (modeLength(mode) == 2) fetched = read(pc + 1);
+            else if constexpr (modeLength(mode) == 3) fetched = ((uint16_t)read(pc + 1) << 8) | read(pc + 2);
+        }
+
+        // Effective address of a memory operand
+        template <AddressingMode mode>
+        uint16_t address() {
+            if constexpr (mode == ZERO_PAGE) return zeroPagedAddress();
+            else if constexpr (mode == ZERO_PAGE_X) return zeroPagedIndexedXAddress();
+            else if constexpr (mode == ZERO_PAGE_Y) return zeroPagedIndexedYAddress();
+            else if constexpr (mode == ABSOLUTE) return absoluteAddress();
+            else if constexpr (mode == ABSOLUTE_X) return absoluteIndexedX();
+            else if constexpr (mode == ABSOLUTE_Y) return absoluteIndexedY();
+            else if constexpr (mode == INDIRECT) return indirectAbsoluteAddress();
+            else if constexpr (mode == INDEXED_INDIRECT) return indexedIndirectAddress();
+            else if constexpr (mode == INDIRECT_INDEXED) return indirectIndexedAddress();
+            else if constexpr (mode == ZERO_PAGE_INDIRECT) return zeroPageIndirectAddress();
+            else if constexpr (mode == ABSOLUTE_INDEXED_INDIRECT) return absoluteIndexedIndirectAddress();
+            else if constexpr (mode == ZERO_PAGE_RELATIVE) return fetched >> 8;
+            else static_assert(mode == ZERO_PAGE, "addressing mode has no memory operand");
+        }
+
+        // Value of a read operand
+        template <AddressingMode mode>
+        uint8_t operand() {
+            if constexpr (mode == IMMEDIATE) return immediateValue();
+            else if constexpr (mode == RELATIVE) return relativeValue();
+            else if constexpr (mode == ABSOLUTE_X || mode == ABSOLUTE_Y || mode == INDIRECT_INDEXED) {
+                uint16_t effective = address<mode>();
+                uint16_t base = effective - (mode == ABSOLUTE_X ? x : y);
+
+                // Indexing across a page boundary costs one extra cycle
+                cycles += (base ^ effective) > 0xff;
+
+                return read(effective);
+            }
+            else return read(address<mode>());
+        }
+
+        // Address of a shift or rotate in memory. The 65C02 only takes the
+        // seventh cycle on abs,X when indexing crosses a page.
+        template <AddressingMode mode>
+        uint16_t shiftAddress() {
+            uint16_t effective = address<mode>();
+            if constexpr (cmos && mode == ABSOLUTE_X) cycles += ((uint16_t)(effective - x) ^ effective) > 0xff;
+            return effective;
+        }
+
+        // RMB, SMB, BBR and BBS, which take their bit number from the opcode
+        template <uint8_t code>
+        void executeBit() {
+            using I = Instruction;
+            constexpr Instruction instruction = opcodes[code].instruction;
+            constexpr uint8_t bit = 1 << (code >> 4 & 7);
+
+            if constexpr (instruction == I::RMB) readModifyWrite<&CPU::template resetBit<bit>>(address<ZERO_PAGE>());
+            else if constexpr (instruction == I::SMB) readModifyWrite<&CPU::template setBit<bit>>(address<ZERO_PAGE>());
+            else {
+                uint8_t value = read(address<ZERO_PAGE_RELATIVE>());
+                branch(((value & bit) != 0) == (instruction == I::BBS), fetched, 3);
+                return;
+            }
+
+            pc += 2;
+        }
+
+        template <Instruction instruction, AddressingMode mode>
+        void execute() {
+            using I = Instruction;
+
+            if constexpr (instruction == I::ADC) ADC(operand<mode>());
+            else if constexpr (instruction == I::ALR) ALR(operand<mode>());
+            else if constexpr (instruction == I::ANC) ANC(operand<mode>());
+            else if constexpr (instruction == I::AND) AND(operand<mode>());
+            else if constexpr (instruction == I::ARR) ARR(operand<mode>());
+            else if constexpr (instruction == I::ASL) {
+                if constexpr (mode == ACCUMULATOR) ASL();
+                else ASL(shiftAddress<mode>());
+            }
+            else if constexpr (instruction == I::BCC) BCC(operand<mode>());
+            else if constexpr (instruction == I::BCS) BCS(operand<mode>());
+            else if constexpr (instruction == I::BEQ) BEQ(operand<mode>());
+            else if constexpr (instruction == I::BIT) {
+                if constexpr (mode == IMMEDIATE) BITImmediate(operand<mode>());
+                else BIT(operand<mode>());
+            }
+            else if constexpr (instruction == I::BMI) BMI(operand<mode>());
+            else if constexpr (instruction == I::BNE) BNE(operand<mode>());
+            else if constexpr (instruction == I::BPL) BPL(operand<mode>());
+            else if constexpr (instruction == I::BRA) BRA(operand<mode>());
+            else if constexpr (instruction == I::BRK) BRK();
+            else if constexpr (instruction == I::BVC) BVC(operand<mode>());
+            else if constexpr (instruction == I::BVS) BVS(operand<mode>());
+            else if constexpr (instruction == I::CLC) CLC();
+            else if constexpr (instruction == I::CLD) CLD();
+            else if constexpr (instruction == I::CLI) CLI();
+            else if constexpr (instruction == I::CLV) CLV();
+            else if constexpr (instruction == I::CMP) CMP(operand<mode>());
+            else if constexpr (instruction == I::CPX) CPX(operand<mode>());
+            else if constexpr (instruction == I::CPY) CPY(operand<mode>());
+            else if constexpr (instruction == I::DCP) DCP(address<mode>());
+            else if constexpr (instruction == I::DEC) {
+                if constexpr (mode == ACCUMULATOR) DEC();
+                else DEC(address<mode>());
+            }
+            else if constexpr (instruction == I::DEX) DEX();
+            else if constexpr (instruction == I::DEY) DEY();
+            else if constexpr (instruction == I::EOR) EOR(operand<mode>());
+            else if constexpr (instruction == I::INC) {
+                if constexpr (mode == ACCUMULATOR) INC();
+                else INC(address<mode>());
+            }
+            else if constexpr (instruction == I::INX) INX();
+            else if constexpr (instruction == I::INY) INY();
+            else if constexpr (instruction == I::ISC) ISC(address<mode>());
+            else if constexpr (instruction == I::JMP) JMP(address<mode>());
+            else if constexpr (instruction == I::JSR) JSR(address<mode>());
+            else if constexpr (instruction == I::LAS) LAS(operand<mode>());
+            else if constexpr (instruction == I::LAX) LAX(operand<mode>());
+            else if constexpr (instruction == I::LDA) LDA(operand<mode>());
+            else if constexpr (instruction == I::LDX) LDX(operand<mode>());
+            else if constexpr (instruction == I::LDY) LDY(operand<mode>());
+            else if constexpr (instruction == I::LSR) {
+                if constexpr (mode == ACCUMULATOR) LSR();
+                else LSR(shiftAddress<mode>());
+            }
+            else if constexpr (instruction == I::NOP) {
+                // Undocumented and 65C02 NOPs with an operand still read it
+                if constexpr (mode == IMPLIED) NOP();
+                else operand<mode>();
+            }
+            else if constexpr (instruction == I::ORA) ORA(operand<mode>());
+            else if constexpr (instruction == I::PHA) PHA();
+            else if constexpr (instruction == I::PHP) PHP();
+            else if constexpr (instruction == I::PHX) PHX();
+            else if constexpr (instruction == I::PHY) PHY();
+            else if constexpr (instruction == I::PLA) PLA();
+            else if constexpr (instruction == I::PLP) PLP();
+            else if constexpr (instruction == I::PLX) PLX();
+            else if constexpr (instruction == I::PLY) PLY();
+            else if constexpr (instruction == I::RLA) RLA(address<mode>());
+            else if constexpr (instruction == I::ROL) {
+                if constexpr (mode == ACCUMULATOR) ROL();
+                else ROL(shiftAddress<mode>());
+            }
+            else if constexpr (instruction == I::ROR) {
+                if constexpr (mode == ACCUMULATOR) ROR();
+                else ROR(shiftAddress<mode>());
+            }
+            else if constexpr (instruction == I::RRA) RRA(address<mode>());
+            else if constexpr (instruction == I::RTI) RTI();
+            else if constexpr (instruction == I::RTS) RTS();
+            else if constexpr (instruction == I::SAX) SAX(address<mode>());
+            else if constexpr (instruction == I::SBC) SBC(operand<mode>());
+            else if constexpr (instruction == I::SBX) SBX(operand<mode>());
+            else if constexpr (instruction == I::SEC) SEC();
+            else if constexpr (instruction == I::SED) SED();
+            else if constexpr (instruction == I::SEI) SEI();
+            else if constexpr (instruction == I::SLO) SLO(address<mode>());
+            else if constexpr (instruction == I::SRE) SRE(address<mode>());
+            else if constexpr (instruction == I::STA) STA(address<mode>());
+            else if constexpr (instruction == I::STX) STX(address<mode>());
+            else if constexpr (instruction == I::STY) STY(address<mode>());
+            else if constexpr (instruction == I::STZ) STZ(address<mode>());
+            else if constexpr (instruction == I::TAX) TAX();
+            else if constexpr (instruction == I::TAY) TAY();
+            else if constexpr (instruction == I::TRB) TRB(address<mode>());
+            else if constexpr (instruction == I::TSB) TSB(address<mode>());
+            else if constexpr (instruction == I::TSX) TSX();
+            else if constexpr (instruction == I::TXA) TXA();
+            else if constexpr (instruction == I::TXS) TXS();
+            else if constexpr (instruction == I::TYA) TYA();
+            else if constexpr (instruction == I::WAI) WAI();
+
+            if constexpr (!changesPC(instruction)) pc += modeLength(mode);
+        }
+
+        template <uint8_t code, bool fetchOperand>
+        static void handler(CPU& cpu) {
+            constexpr Opcode opcode = opcodes[code];
+
+            if constexpr (fetchOperand) cpu.template fetch<opcode.mode>();
+
+            if constexpr (opcode.instruction == Instruction::UNKNOWN) {
+                cpu.unknownOpcode();
+                return;
+            } else if constexpr (opcode.instruction == Instruction::BRK) {
+                if (cpu.stopOnBRK) {
+                    cpu.stop(StopReason::BRK);
+                    return;
+                }
+            } else if constexpr (opcode.instruction == Instruction::STP) {
+                cpu.stop(StopReason::STOPPED);
+                return;
+            }
+
+            if constexpr (isBitInstruction(opcode.instruction)) cpu.template executeBit<code>();
+            else cpu.template execute<opcode.instruction, opcode.mode>();
+            cpu.cycles += opcode.cycles;
+            cpu.instructions++;
+        }
+
+        template <bool fetchOperand, size_t... codes>
+        static constexpr std::array<Handler, 256> makeHandlers(std::index_sequence<codes...>) {
+            return {{&handler<codes, fetchOperand>...}};
+        }
+
+        // Handlers that fetch their operand bytes, and ones that take them predecoded
+        static const std::array<Handler, 256> handlers;
+        static const std::array<Handler, 256> decodedHandlers;
+
+        void unknownOpcode() {
+            stop(StopReason::UNKNOWN_OPCODE);
+        }
+        
+        // instructions
+
+        void NOP() {}
+
+        void BRK() {
+            pc += 1;
+
+            pushPC();
+            pushStack(getPSR());
+
+            pc = ((uint16_t)read(IRQ-1) << 8) | read(IRQ);
+
+            setFlag(BREAK_FLAG);
+            setFlag(INTERRUPT_FLAG);
+            if constexpr (cmos) unsetFlag(DECIMAL_FLAG);
+        }
+
+        void ORA(uint8_t operand) {
+            accumulator |= operand;
+
+            setNZ(accumulator);
+        }
+
+        void ASL(uint16_t operand) {
+            readModifyWrite<&CPU::shiftLeft>(operand);
+        }
+
+        void ASL() {
+            accumulator = shiftLeft(accumulator);
+        }
+
+        void PHP() {
+            pushStack(getPSR());
+        }
+
+        void BPL(uint8_t operand) {
+            branch(!checkFlag(NEGATIVE_FLAG), operand);
+        }
+
+        void CLC() {
+            unsetFlag(CARRY_FLAG);
+        }
+
+        void JSR(uint16_t operand) {
+            pc += 3;
+
+            pushPC();
+
+            pc = operand;
+        }
+
+        void AND(uint8_t operand) { 
+            accumulator &= operand;
+
+            setNZ(accumulator);
+        }
+
+        // The 65C02's BIT # only sets Z
+        void BITImmediate(uint8_t operand) {
+            setZ(accumulator & operand);
+        }
+
+        void BIT(uint8_t operand) {
+            uint8_t temp = accumulator & operand;
+            
+            setOverflow((temp & 0x40) > 0);
+
+            setNZ(temp);
+        }
+
+        void ROL(uint16_t operand) {
+            readModifyWrite<&CPU::rotateLeft>(operand);
+        }
+
+        void ROL() {
+            accumulator = rotateLeft(accumulator);
+        }
+
+        void PLP() {
+            setPSR(pullStack());
+        }
+        
+        void BMI(uint8_t operand) {
+            branch(checkFlag(NEGATIVE_FLAG), operand);
+        }
+
+        void SEC() {
+            setFlag(CARRY_FLAG);
+        }
+
+        void RTI() {
+            setPSR(pullStack());
+            pc = pullPC();
+        }
+
+        void EOR(uint8_t operand) {
+            accumulator ^= operand;
+
+            setNZ(accumulator);
+        }
+
+        void LSR(uint16_t operand) {
+            readModifyWrite<&CPU::shiftRight>(operand);
+        }
+
+        void LSR() {
+            accumulator = shiftRight(accumulator);
+        }
+
+        void PHA() {
+            pushStack(accumulator);
+        }
+
+        void PHX() {
+            pushStack(x);
+        }
+
+        void PHY() {
+            pushStack(y);
+        }
+
+        void JMP(uint16_t operand) {
+            if (stopOnHaltLoop && operand == pc) stop(StopReason::HALT_LOOP);
+
+            pc = operand;
+        }
+
+        void BRA(uint8_t operand) {
+            branch(true, operand);
+        }
+
+        void BVC(uint8_t operand) {
+            branch(!checkFlag(OVERFLOW_FLAG), operand);
+        }
+
+        void CLI() {
+            unsetFlag(INTERRUPT_FLAG);
+        }
+
+        void RTS() {
+            pc = pullPC();
+        }
+
+        void ADC(uint8_t operand) {
+            bool carry = checkFlag(CARRY_FLAG);
+
+            if constexpr (hasDecimalMode) {
+                if (checkFlag(DECIMAL_FLAG)) {
+                    decimal<cmos ? cmosDecimalAdd : decimalAdd>(operand, carry);
+                    return;
+                }
+            }
+
+            uint16_t temp = (uint16_t)accumulator + operand + carry;
+
+            setOverflow((~(accumulator ^ operand) & (accumulator ^ temp) & 0x80) != 0);
+            setCarry(temp > 0xff);
+
+            accumulator = (uint8_t)temp;
+
+            setNZ(accumulator);
+        }
+
+        void ROR(uint16_t operand) {
+            readModifyWrite<&CPU::rotateRight>(operand);
+        }
+
+        void ROR() {
+            accumulator = rotateRight(accumulator);
+        }
+
+        void TRB(uint16_t operand) {
+            readModifyWrite<&CPU::testAndReset>(operand);
+        }
+
+        void TSB(uint16_t operand) {
+            readModifyWrite<&CPU::testAndSet>(operand);
+        }
+
+        // Waits where it is until an interrupt is pending, masked or not.
+        // The lines come from outside, so the input log has the last word.
+        void WAI() {
+            bool pending = interrupts.any();
+            if (inputLog != nullptr) pending = inputLog->wake(pending);
+
+            if (pending) pc += 1;
+        }
+
+        void PLA() {
+            accumulator = pullStack();
+
+            setNZ(accumulator);
+        }
+
+        void PLX() {
+            x = pullStack();
+
+            setNZ(x);
+        }
+
+        void PLY() {
+            y = pullStack();
+
+            setNZ(y);
+        }
+
+        void BVS(uint8_t operand) {
+            branch(checkFlag(OVERFLOW_FLAG), operand);
+        }
+
+        void STA(uint16_t operand) {
+            write(operand, accumulator);
+        }
+
+        void STY(uint16_t operand) {
+            write(operand, y);
+        }
+
+        void STX(uint16_t operand) {
+            write(operand, x);
+        }
+
+        void STZ(uint16_t operand) {
+            write(operand, 0);
+        }
+
+        void DEY() {
+            y--;
+            
+            setNZ(y);
+        }
+
+        void TXA() {
+            accumulator = x;
+
+            setNZ(accumulator);
+        }
+
+        void BCC(uint8_t operand) {
+            branch(!checkFlag(CARRY_FLAG), operand);
+        }
+
+        void TYA() {
+            accumulator = y;
+
+            setNZ(accumulator);
+        }
+
+        void TXS() {
+            sp = x;
+        }
+
+        void LDY(uint8_t operand) {
+            y = operand;
+
+            setNZ(y);
+        }
+
+        void LDA(uint8_t operand) {
+            accumulator = operand;
+
+            setNZ(accumulator);
+        }
+
+        void LDX(uint8_t operand) {
+            x = operand;
+
+            setNZ(x);
+        }
+
+        void TAY() {
+            y = accumulator;
+
+            setNZ(y);
+        }
+
+        void TAX() {
+            x = accumulator;
+
+            setNZ(x);
+        }
+
+        void BCS(uint8_t operand) {
+            branch(checkFlag(CARRY_FLAG), operand);
+        }
+
+        void CLV() {
+            unsetFlag(OVERFLOW_FLAG);
+        }
+
+        void TSX() {
+            sp = x;
+        }
+
+        void CPY(uint8_t operand) {
+            setCarry(y >= operand);
+
+            uint8_t temp = y - operand;
+
+            setNZ(temp);
+        }
+
+        void CMP(uint8_t operand) {
+            setCarry(accumulator > operand);
+
+            uint8_t temp = accumulator - operand;
+
+            setNZ(temp);
+        }
+
+        void DEC(uint16_t operand) {
+            readModifyWrite<&CPU::decrement>(operand);
+        }
+
+        void DEC() {
+            accumulator = decrement(accumulator);
+        }
+
+        void INY() {
+            y++;
+
+            setNZ(y);
+        }
+
+        void DEX() {
+            x--;
+
+            setNZ(x);
+        }
+
+        void BNE(uint8_t operand) {
+            branch(!checkFlag(ZERO_FLAG), operand);
+        }
+
+        void CLD() {
+            unsetFlag(DECIMAL_FLAG);
+        }
+
+        void CPX(uint8_t operand) {
+            setCarry(x > operand);
+
+            uint8_t temp = x - operand;
+
+            setNZ(temp);
+        }
+
+        void SBC(uint8_t operand) {
+            bool carry = checkFlag(CARRY_FLAG);
+
+            if constexpr (hasDecimalMode) {
+                if (checkFlag(DECIMAL_FLAG)) {
+                    decimal<cmos ? cmosDecimalSubtract : decimalSubtract>(operand, carry);
+                    return;
+                }
+            }
+
+            uint8_t oldA = accumulator;
+            uint16_t temp = (uint16_t)oldA + (operand ^ 0xFF) + carry;
+
+            setOverflow(((oldA ^ temp) & (operand ^ temp) & 0x80) != 0);
+            setCarry((temp & 0x100) != 0);
+
+            accumulator = (uint8_t)(temp & 0xFF);
+
+            setNZ(accumulator);
+        }
+
+        void INC(uint16_t operand) {
+            readModifyWrite<&CPU::increment>(operand);
+        }
+
+        void INC() {
+            accumulator = increment(accumulator);
+        }
+
+        void INX() {
+            x++;
+
+            setNZ(x);
+        }
+
+        void BEQ(uint8_t operand) {
+            branch(checkFlag(ZERO_FLAG), operand);
+        }
+
+        void SED() {
+            setFlag(DECIMAL_FLAG);
+        }
+
+        void SEI() {
+            setFlag(INTERRUPT_FLAG);
+        }
+
+        // undocumented NMOS instructions
+
+        void LAX(uint8_t operand) {
+            accumulator = x = operand;
+
+            setNZ(x);
+        }
+
+        void SAX(uint16_t operand) {
+            write(operand, accumulator & x);
+        }
+
+        void LAS(uint8_t operand) {
+            accumulator = x = sp = operand & sp;
+
+            setNZ(x);
+        }
+
+        void DCP(uint16_t operand) {
+            CMP(readModifyWrite<&CPU::decrement>(operand));
+        }
+
+        void ISC(uint16_t operand) {
+            SBC(readModifyWrite<&CPU::increment>(operand));
+        }
+
+        void SLO(uint16_t operand) {
+            ORA(readModifyWrite<&CPU::shiftLeft>(operand));
+        }
+
+        void RLA(uint16_t operand) {
+            AND(readModifyWrite<&CPU::rotateLeft>(operand));
+        }
+
+        void SRE(uint16_t operand) {
+            EOR(readModifyWrite<&CPU::shiftRight>(operand));
+        }
+
+        void RRA(uint16_t operand) {
+            ADC(readModifyWrite<&CPU::rotateRight>(operand));
+        }
+
+        void ANC(uint8_t operand) {
+            AND(operand);
+
+            setCarry((accumulator & 0x80) != 0);
+        }
+
+        void ALR(uint8_t operand) {
+            accumulator = shiftRight(accumulator & operand);
+        }
+
+        // The binary result, in decimal mode as well
+        void ARR(uint8_t operand) {
+            accumulator = ((accumulator & operand) >> 1) | (checkFlag(CARRY_FLAG) ? 0x80 : 0);
+
+            setNZ(accumulator);
+            setCarry((accumulator & 0x40) != 0);
+            setOverflow(((accumulator >> 6) ^ (accumulator >> 5)) & 1);
+        }
+
+        void SBX(uint8_t operand) {
+            uint8_t value = accumulator & x;
+
+            setCarry(value >= operand);
+
+            x = value - operand;
+
+            setNZ(x);
+        }
+};
+
+template <typename Trace, Variant cpuVariant>
+const std::array<typename CPU<Trace, cpuVariant>::Handler, 256> CPU<Trace, cpuVariant>::handlers = CPU<Trace, cpuVariant>::makeHandlers<true>(std::make_index_sequence<256>());
+
+template <typename Trace, Variant cpuVariant>
+const std::array<typename CPU<Trace, cpuVariant>::Handler, 256> CPU<Trace, cpuVariant>::decodedHandlers = CPU<Trace, cpuVariant>::makeHandlers<false>(std::make_index_sequence<256>());
+
+template <typename Trace, Variant cpuVariant>
+const std::array<typename CPU<Trace, cpuVariant>::OpHandler, 256> CPU<Trace, cpuVariant>::singleHandlers = CPU<Trace, cpuVariant>::makeSingleHandlers(std::make_index_sequence<256>());
+
+template <typename Trace, Variant cpuVariant>
+const std::array<typename CPU<Trace, cpuVariant>::OpHandler, CPU<Trace, cpuVariant>::PAIR_CODES * CPU<Trace, cpuVariant>::PAIR_CODES> CPU<Trace, cpuVariant>::pairHandlers =
+    CPU<Trace, cpuVariant>::makePairHandlers(std::make_index_sequence<PAIR_CODES * PAIR_CODES>());
+
+template <typename Trace, Variant cpuVariant>
+const std::array<typename CPU<Trace, cpuVariant>::OpHandler, sizeof(CPU<Trace, cpuVariant>::tripleFirst) * CPU<Trace, cpuVariant>::TRIPLE_SECOND * CPU<Trace, cpuVariant>::TRIPLE_THIRD> CPU<Trace, cpuVariant>::tripleHandlers =
+    CPU<Trace, cpuVariant>::makeTripleHandlers(std::make_index_sequence<sizeof(tripleFirst) * TRIPLE_SECOND * TRIPLE_THIRD>());
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+
+/*
+Decimal mode ADC and SBC as the NMOS 6502 does them, including what it does
+with digits above 9 and where N, V and Z come from: ADC takes N and V from
+the sum before its high digit is adjusted and Z from the binary sum, SBC
+sets every flag from the binary difference. The 65C02 sets N and Z from the
+result and adjusts SBC results differently for digits above 9.
+    - http://www.6502.org/tutorials/decimal_mode.html
+
+The CPU looks results up in tables built from the same functions at
+compile time, indexed by carry, A and the operand, 256K per function a
+CPU variant uses. Build with -DDECIMAL_TABLES=0 to compute them instead.
+*/
+
+#ifndef DECIMAL_TABLES
+#define DECIMAL_TABLES 1
+#endif
+
+// Flags in their P positions, only C, Z, V and N are meaningful
+struct DecimalResult {
+    uint8_t value;
+    uint8_t flags;
+};
+
+constexpr uint8_t decimalFlags(bool carry, bool zero, bool overflow, bool negative) {
+    return (carry ? 0x01 : 0) | (zero ? 0x02 : 0) | (overflow ? 0x40 : 0) | (negative ? 0x80 : 0);
+}
+
+constexpr DecimalResult decimalAdd(uint8_t a, uint8_t operand, bool carry) {
+    int low = (a & 0x0f) + (operand & 0x0f) + carry;
+    if (low >= 0x0a) low = ((low + 0x06) & 0x0f) + 0x10;
+
+    int sum = (a & 0xf0) + (operand & 0xf0) + low;
+    bool negative = (sum & 0x80) != 0;
+    bool overflow = (~(a ^ operand) & (a ^ sum) & 0x80) != 0;
+    bool zero = ((a + operand + carry) & 0xff) == 0;
+
+    if (sum >= 0xa0) sum += 0x60;
+
+    return {(uint8_t)sum, decimalFlags(sum >= 0x100, zero, overflow, negative)};
+}
+
+constexpr DecimalResult decimalSubtract(uint8_t a, uint8_t operand, bool carry) {
+    int binary = a - operand - !carry;
+    bool overflow = ((a ^ operand) & (a ^ binary) & 0x80) != 0;
+
+    int low = (a & 0x0f) - (operand & 0x0f) - !carry;
+    if (low < 0) low = ((low - 0x06) & 0x0f) - 0x10;
+
+    int difference = (a & 0xf0) - (operand & 0xf0) + low;
+    if (difference < 0) difference -= 0x60;
+
+    return {(uint8_t)difference, decimalFlags(binary >= 0, (binary & 0xff) == 0, overflow, (binary & 0x80) != 0)};
+}
+
+// N and Z from the result, the rest as the NMOS does it
+constexpr DecimalResult cmosDecimalAdd(uint8_t a, uint8_t operand, bool carry) {
+    DecimalResult result = decimalAdd(a, operand, carry);
+    result.flags = (result.flags & 0x41) | decimalFlags(false, result.value == 0, false, (result.value & 0x80) != 0);
+    return result;
+}
+
+constexpr DecimalResult cmosDecimalSubtract(uint8_t a, uint8_t operand, bool carry) {
+    int binary = a - operand - !carry;
+    bool overflow = ((a ^ operand) & (a ^ binary) & 0x80) != 0;
+
+    int low = (a & 0x0f) - (operand & 0x0f) - !carry;
+    int difference = binary;
+    if (difference < 0) difference -= 0x60;
+    if (low < 0) difference -= 0x06;
+
+    uint8_t value = difference;
+    return {value, decimalFlags(binary >= 0, value == 0, overflow, (value & 0x80) != 0)};
+}
+
+using DecimalOperation = DecimalResult (*)(uint8_t, uint8_t, bool);
+
+#if DECIMAL_TABLES
+template <DecimalOperation operation>
+constexpr std::array<DecimalResult, 0x20000> makeDecimalTable() {
+    std::array<DecimalResult, 0x20000> table = {};
+    for (int i = 0; i < 0x20000; i++) table[i] = operation(i >> 8 & 0xff, i & 0xff, i >> 16);
+    return table;
+}
+
+// Only built for the operations a CPU variant uses
+template <DecimalOperation operation>
+inline constexpr std::array<DecimalResult, 0x20000> decimalTable = makeDecimalTable<operation>();
+#endif
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <algorithm>
+#include <array>
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "bus.h"
+#include "interrupts.h"
+#include "scheduler.h"
+
+/*
+Peripherals written as coroutines. A Device has 256 registers the CPU reads
+and writes, and a behaviour() coroutine that waits on the emulated machine
+instead of on the host:
+    co_await cycles(n)         resumes n CPU cycles later
+    co_await writeTo(reg)      resumes after the CPU writes reg, gives the value
+Coroutines are resumed from the scheduler at instruction boundaries, on the
+emulation thread, so a device needs neither a thread nor locking and behaves
+the same on every run.
+
+    class Timer : public Device {
+        Task behaviour() override {
+            while (true) {
+                co_await cycles(registers[0] * 256);
+                interrupts->assertIRQ(1);
+                co_await writeTo(1);
+                interrupts->releaseIRQ(1);
+            }
+        }
+    };
+*/
+
+// Recycles coroutine frames, which all devices allocate from the same few sizes
+class FramePool {
+    static constexpr size_t GRANULE = 64;
+
+    // Frames up to 1 KB are pooled, bigger ones go to the heap
+    static constexpr size_t CLASSES = 16;
+
+    struct Block {
+        Block* next;
+    };
+
+    struct FreeLists {
+        Block* heads[CLASSES] = {};
+
+        ~FreeLists() {
+            for (Block* head: heads) {
+                while (head != nullptr) {
+                    Block* next = head->next;
+                    ::operator delete(head);
+                    head = next;
+                }
+            }
+        }
+    };
+
+    // One set of lists per thread, so batch workers never contend
+    static FreeLists& freeLists() {
+        thread_local FreeLists lists;
+        return lists;
+    }
+
+    public:
+        static void* allocate(size_t size) {
+            size_t sizeClass = (size - 1) / GRANULE;
+            if (sizeClass >= CLASSES) return ::operator new(size);
+
+            Block*& head = freeLists().heads[sizeClass];
+            if (head == nullptr) return ::operator new((sizeClass + 1) * GRANULE);
+
+            Block* block = head;
+            head = block->next;
+            return block;
+        }
+
+        static void release(void* frame, size_t size) {
+            size_t sizeClass = (size - 1) / GRANULE;
+            if (sizeClass >= CLASSES) {
+                ::operator delete(frame);
+                return;
+            }
+
+            Block*& head = freeLists().heads[sizeClass];
+            Block* block = (Block*)frame;
+            block->next = head;
+            head = block;
+        }
+};
+
+// A device coroutine. It starts suspended and its frame lives as long as the Task.
+class Task {
+    public:
+        struct promise_type {
+            Task get_return_object() {
+                return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept {
+                return {};
+            }
+
+            std::suspend_always final_suspend() noexcept {
+                return {};
+            }
+
+            void return_void() {}
+
+            void unhandled_exception() {
+                std::terminate();
+            }
+
+            static void* operator new(size_t size) {
+                return FramePool::allocate(size);
+            }
+
+            static void operator delete(void* frame, size_t size) {
+                FramePool::release(frame, size);
+            }
+        };
+
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+
+        Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+        Task& operator=(Task&& other) noexcept {
+            std::swap(handle, other.handle);
+            return *this;
+        }
+
+        ~Task() {
+            if (handle) handle.destroy();
+        }
+
+        bool done() const {
+            return !handle || handle.done();
+        }
+
+    private:
+        friend class Device;
+
+        std::coroutine_handle<promise_type> handle;
+
+        explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+};
+
+class Device : public Peripheral {
+    struct WriteWaiter {
+        uint8_t reg;
+        uint8_t value;
+        std::coroutine_handle<> handle;
+    };
+
+    std::vector<Task> tasks;
+
+    // Coroutines waiting for the CPU to write a register
+    std::vector<WriteWaiter*> writeWaiters;
+
+    // Timestamp the running coroutine was resumed for
+    uint64_t wakeTime = 0;
+
+    struct CyclesAwaiter {
+        Device& device;
+        uint64_t cycles;
+
+        bool await_ready() const {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            device.resumeAt(device.wakeTime + cycles, handle);
+        }
+
+        void await_resume() const {}
+    };
+
+    struct WriteAwaiter {
+        Device& device;
+        WriteWaiter waiter;
+
+        bool await_ready() const {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            waiter.handle = handle;
+            device.writeWaiters.push_back(&waiter);
+        }
+
+        uint8_t await_resume() const {
+            return waiter.value;
+        }
+    };
+
+    public:
+        std::array<uint8_t, 0x100> registers = {};
+
+        // Queued events hold this and the coroutine frames, which go with the device
+        ~Device() override {
+            if (scheduler != nullptr) scheduler->cancelOwned(this);
+        }
+
+        // Starts behaviour() once the device is on a machine
+        void attach(Scheduler& scheduler, InterruptLines& interrupts) override {
+            this->scheduler = &scheduler;
+            this->interrupts = &interrupts;
+
+            spawn(behaviour());
+        }
+
+        void write(uint8_t address, uint8_t value) override {
+            registers[address] = value;
+
+            for (size_t i = 0; i < writeWaiters.size();) {
+                WriteWaiter* waiter = writeWaiters[i];
+                if (waiter->reg != address) {
+                    i++;
+                    continue;
+                }
+
+                // Resumed after the writing instruction, not in the middle of it
+                waiter->value = value;
+                resumeAt(scheduler->now(), waiter->handle);
+
+                writeWaiters[i] = writeWaiters.back();
+                writeWaiters.pop_back();
+            }
+        }
+
+        uint8_t read(uint8_t address) override {
+            return registers[address];
+        }
+
+        // Registers only change on CPU writes and in behaviour(), which runs
+        // from the scheduler. Devices that override read() should say again.
+        bool steadyReads() const override {
+            return true;
+        }
+
+        // Only the registers: a suspended coroutine cannot be copied, so a
+        // restore drops the device's pending events and coroutines and starts
+        // behaviour() over from the restored registers, at the restored time
+        std::vector<uint8_t> saveState() override {
+            return std::vector<uint8_t>(registers.begin(), registers.end());
+        }
+
+        void loadState(const std::vector<uint8_t>& state) override {
+            if (state.size() == registers.size()) std::copy(state.begin(), state.end(), registers.begin());
+
+            if (scheduler == nullptr) return;
+
+            // The events resume coroutine frames, so they go first
+            scheduler->cancelOwned(this);
+            writeWaiters.clear();
+            tasks.clear();
+
+            spawn(behaviour());
+        }
+
+        // Suspended coroutines and their events are not in the saved state
+        bool rewindable() const override {
+            return false;
+        }
+
+    protected:
+        Scheduler* scheduler = nullptr;
+        InterruptLines* interrupts = nullptr;
+
+        virtual Task behaviour() = 0;
+
+        // Runs another coroutine alongside behaviour(), starting now
+        void spawn(Task task) {
+            wakeTime = scheduler->now();
+            tasks.push_back(std::move(task));
+            tasks.back().handle.resume();
+        }
+
+        // Emulated time as seen by the running coroutine. Waits are measured
+        // from the time it was due, not from when it actually ran, so periodic
+        // devices do not drift.
+        uint64_t now() const {
+            return wakeTime;
+        }
+
+        CyclesAwaiter cycles(uint64_t cycles) {
+            return {*this, cycles};
+        }
+
+        WriteAwaiter writeTo(uint8_t reg) {
+            return {*this, {reg, 0, nullptr}};
+        }
+
+    private:
+        void resumeAt(uint64_t when, std::coroutine_handle<> handle) {
+            scheduler->at(when, [this, handle](uint64_t when) {
+                wakeTime = when;
+                handle.resume();
+            }, this);
+        }
+};
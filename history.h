@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cstdint>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+
+#include "machine.h"
+#include "replay.h"
+#include "snapshot.h"
+
+/*
+Reverse execution for debugging. History drives a machine forward, takes a
+snapshot every `interval` instructions and records device reads and
+interrupts into an in-memory InputLog. Going back restores the nearest
+snapshot at or before the target and re-executes from it with the log
+replayed, so stepping back N instructions costs at most one interval of
+re-execution.
+
+Snapshots share unchanged pages, so one costs roughly the pages written
+since the previous one. When snapshots and log together exceed the memory
+budget, the oldest snapshots (and the log before them) are dropped, which
+limits how far back one can go, not how fast.
+
+Run the machine only through History while it is attached. Going back needs
+every peripheral to be rewindable(): a coroutine Device's suspended state and
+pending events cannot be captured, so with one attached History still runs
+forward but refuses to rewind.
+*/
+
+template <typename Trace=NoTrace, Variant variant=Variant::NMOS>
+class History {
+    struct Point {
+        Snapshot snapshot;
+        InputLog::Position position;
+
+        // Bytes this snapshot holds that the one before it does not
+        size_t cost;
+    };
+
+    static constexpr size_t PAGE_COST = sizeof(PageData) + 32;
+
+    // More than an interrupt entry and the longest instruction take together
+    static constexpr uint64_t STEP_CYCLES = 16;
+
+    Machine<Trace, variant>& machine;
+    InputLog log;
+
+    std::deque<Point> points;
+    uint64_t interval;
+    size_t budget;
+    size_t used = 0;
+
+    public:
+        // Starts recording from the machine's current state
+        History(Machine<Trace, variant>& machine, uint64_t interval=100000, size_t budget=64 << 20)
+            : machine(machine), interval(std::max<uint64_t>(interval, 1)), budget(budget) {
+            std::string error;
+            machine.record(log, "", error);
+            takeSnapshot();
+        }
+
+        History(const History&) = delete;
+        History& operator=(const History&) = delete;
+
+        // Instruction count of the oldest state still reachable
+        uint64_t earliest() const {
+            return points.front().snapshot.instructions;
+        }
+
+        size_t memoryUsed() const {
+            return used + log.bytes().size();
+        }
+
+        // Whether going back is possible with the peripherals attached
+        bool rewindable() const {
+            return std::all_of(machine.bus.peripherals.begin(), machine.bus.peripherals.end(), [](const Peripheral* peripheral) {
+                return peripheral->rewindable();
+            });
+        }
+
+        // Forward runs, stopping at breakpoints like the plain CPU calls
+        RunResult step(uint64_t count=1) {
+            return forward(count, false);
+        }
+
+        RunResult run(uint64_t cycles) {
+            return forward(cycles, true);
+        }
+
+        // Back count instructions, or as far as history goes. False if it did not get all the way.
+        bool stepBack(uint64_t count=1) {
+            if (!rewindable()) return count == 0;
+
+            uint64_t now = machine.cpu.instructions;
+            uint64_t target = count > now - earliest() ? earliest() : now - count;
+
+            seek(target);
+            return now - target == count;
+        }
+
+        // Back to the last time execution stopped at a breakpoint before now,
+        // or to the start of history if there was none. Does nothing if not rewindable().
+        RunResult reverseContinue() {
+            if (!rewindable()) return {StopReason::BUDGET, 0, 0};
+
+            CPU<Trace, variant>& cpu = machine.cpu;
+            uint64_t startCycles = cpu.cycles;
+            uint64_t startInstructions = cpu.instructions;
+
+            uint64_t end = cpu.instructions;
+            size_t index = pointBefore(end > 0 ? end - 1 : 0);
+
+            while (true) {
+                // Replay one interval, remembering the last breakpoint hit in it
+                const Point& point = points[index];
+                goTo(point, point.snapshot.instructions);
+
+                uint64_t hit = UINT64_MAX;
+                if (cpu.isBreakpoint(cpu.pc) && cpu.instructions < end) hit = cpu.instructions;
+
+                while (cpu.instructions < end) {
+                    RunResult result = cpu.runInstructions(end - cpu.instructions);
+                    if (result.reason == StopReason::BREAKPOINT && cpu.instructions < end) hit = cpu.instructions;
+                    else if (result.reason != StopReason::BUDGET && result.instructions == 0) break;
+                }
+
+                if (hit != UINT64_MAX) {
+                    seek(hit);
+                    return {StopReason::BREAKPOINT, cpu.cycles - startCycles, cpu.instructions - startInstructions};
+                }
+
+                if (index == 0) {
+                    seek(earliest());
+                    return {StopReason::BUDGET, cpu.cycles - startCycles, cpu.instructions - startInstructions};
+                }
+
+                end = point.snapshot.instructions;
+                index--;
+            }
+        }
+
+        // Puts the machine in the state it had after `instructions` instructions.
+        // False, leaving the machine alone, if not rewindable().
+        bool seek(uint64_t instructions) {
+            if (!rewindable()) return false;
+
+            instructions = std::max(instructions, earliest());
+            goTo(points[pointBefore(instructions)], instructions);
+            return true;
+        }
+
+    private:
+        size_t pointBefore(uint64_t instructions) const {
+            size_t index = points.size() - 1;
+            while (index > 0 && points[index].snapshot.instructions > instructions) index--;
+            return index;
+        }
+
+        // Restores point and re-executes up to target, breakpoints are passed over
+        void goTo(const Point& point, uint64_t target) {
+            CPU<Trace, variant>& cpu = machine.cpu;
+
+            machine.restore(point.snapshot);
+            log.seek(point.position);
+
+            while (cpu.instructions < target) {
+                RunResult result = cpu.runInstructions(target - cpu.instructions);
+                if (result.reason != StopReason::BUDGET && result.reason != StopReason::BREAKPOINT) break;
+            }
+        }
+
+        RunResult forward(uint64_t budget, bool inCycles) {
+            CPU<Trace, variant>& cpu = machine.cpu;
+            uint64_t startCycles = cpu.cycles;
+            uint64_t startInstructions = cpu.instructions;
+
+            RunResult result = {StopReason::BUDGET, 0, 0};
+
+            while ((inCycles ? cpu.cycles - startCycles : cpu.instructions - startInstructions) < budget) {
+                uint64_t next = points.back().snapshot.instructions + interval;
+                if (cpu.instructions >= next) {
+                    takeSnapshot();
+                    next = cpu.instructions + interval;
+                }
+
+                // Snapshots land on instruction counts, so cycle budgets are run in
+                // instruction slices too. A slice of left / STEP_CYCLES instructions
+                // fits in what is left, and near the end they go one at a time, so
+                // the run ends at most one instruction past the budget like runCycles.
+                uint64_t left = budget - (inCycles ? cpu.cycles - startCycles : cpu.instructions - startInstructions);
+                uint64_t count = inCycles ? std::max<uint64_t>(left / STEP_CYCLES, 1) : left;
+
+                result = cpu.runInstructions(std::min(next - cpu.instructions, count));
+
+                if (result.reason != StopReason::BUDGET) break;
+            }
+
+            return {result.reason, cpu.cycles - startCycles, cpu.instructions - startInstructions};
+        }
+
+        void takeSnapshot() {
+            Point point = {machine.snapshot(), log.tell(), 0};
+            point.cost = cost(point, points.empty() ? nullptr : &points.back());
+            used += point.cost;
+            points.push_back(std::move(point));
+
+            while (memoryUsed() > budget && points.size() > 1) {
+                used -= points[0].cost + points[1].cost;
+                points.pop_front();
+                points[0].cost = cost(points[0], nullptr);
+                used += points[0].cost;
+
+                log.discard(points[0].position);
+            }
+        }
+
+        static size_t cost(const Point& point, const Point* previous) {
+            size_t bytes = sizeof(Point);
+            for (int page = 0; page < 0x100; page++) {
+                const auto& data = point.snapshot.pages[page];
+                if (data != nullptr && (previous == nullptr || previous->snapshot.pages[page] != data)) bytes += PAGE_COST;
+            }
+            for (const auto& state: point.snapshot.devices) bytes += state.size();
+            return bytes;
+        }
+};
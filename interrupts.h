@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/*
+Interrupt inputs of the CPU, safe to drive from any thread.
+    - IRQ is level triggered: each source holds its own bit until it releases
+      it, the line is asserted while any source is
+    - NMI is edge triggered: a pulse is latched until the CPU takes it
+Everything lives in one atomic word, so the run loop checks for interrupts
+with a single relaxed load per instruction.
+*/
+
+class InterruptLines {
+    static constexpr uint32_t NMI_LATCHED = 0x1;
+
+    // Bit 0 is the NMI latch, bits 1..31 are IRQ sources
+    std::atomic<uint32_t> pending{0};
+
+    public:
+        static constexpr unsigned IRQ_SOURCES = 31;
+
+        void assertIRQ(unsigned source=0) {
+            pending.fetch_or(2u << source, std::memory_order_release);
+        }
+
+        void releaseIRQ(unsigned source=0) {
+            pending.fetch_and(~(2u << source), std::memory_order_release);
+        }
+
+        void triggerNMI() {
+            pending.fetch_or(NMI_LATCHED, std::memory_order_release);
+        }
+
+        // Hot path: anything at all to look at?
+        bool any() const {
+            return pending.load(std::memory_order_relaxed) != 0;
+        }
+
+        bool irq() const {
+            return (pending.load(std::memory_order_acquire) & ~NMI_LATCHED) != 0;
+        }
+
+        // Clears the latch, true if an NMI was pending
+        bool takeNMI() {
+            return (pending.fetch_and(~NMI_LATCHED, std::memory_order_acq_rel) & NMI_LATCHED) != 0;
+        }
+
+        void clear() {
+            pending.store(0, std::memory_order_release);
+        }
+
+        // The word itself, for compiled code that tests it inline
+        const std::atomic<uint32_t>& lines() const {
+            return pending;
+        }
+
+        // Raw line state, for snapshots
+        uint32_t state() const {
+            return pending.load(std::memory_order_acquire);
+        }
+
+        void setState(uint32_t state) {
+            pending.store(state, std::memory_order_release);
+        }
+};
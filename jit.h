@@ -0,0 +1,969 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "bus.h"
+#include "opcodes.h"
+
+/*
+Dynamic recompiler for x86-64 hosts. Basic blocks that have run often enough
+are compiled to native code with A, X, Y and P held in host registers:
+    rbx = A, rbp = X, r15 = Y, r13 = P, r14 = cycles, r12 = the CPU
+Only a common subset is compiled (loads, stores, logic, compares, register
+moves and counting, INC/DEC, flag instructions, branches and JMP). A block
+ends before the first instruction outside it and the interpreter carries on
+from there.
+
+Memory accesses test the page table at run time: RAM and ROM are read and
+written inline, device pages and write-protected pages call back into the
+bus. Between instructions the code leaves the same way the block
+interpreter does: at the run limit, on a pending interrupt, or when a write
+changed a page with cached code. Results, cycle counts included, are the
+same as the interpreter's.
+
+With a perf map, every block is listed in /tmp/perf-PID.map under its 6502
+address, so `perf report` names compiled code instead of showing raw
+addresses.
+
+A block is compiled on its JIT_HOT-th run (default 16). The tests build with
+a lower value so that code which runs only a few times is compiled too.
+*/
+
+#ifndef JIT_HOT
+#define JIT_HOT 16
+#endif
+
+// x86-64 machine code, only the forms the recompiler needs. Operations are
+// 32-bit unless the name says otherwise, memory operands are [base + index + disp32].
+class Assembler {
+    public:
+        enum Register : uint8_t {
+            RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15,
+            NONE = 0xff
+        };
+
+        enum Condition : uint8_t {
+            BELOW = 0x2, ABOVE_EQUAL = 0x3, EQUAL = 0x4, NOT_EQUAL = 0x5, ABOVE = 0x7
+        };
+
+        enum Alu : uint8_t {
+            ADD = 0, OR = 1, AND = 4, SUB = 5, XOR = 6, CMP = 7
+        };
+
+        // Position just past the rel32 of a jump whose target is bound later
+        using Label = size_t;
+
+        std::vector<uint8_t> bytes;
+
+        size_t here() const {
+            return bytes.size();
+        }
+
+        void mov(Register dst, Register src) {
+            rex(false, src, NONE, dst);
+            emit(0x89);
+            direct(src, dst);
+        }
+
+        void mov(Register dst, uint32_t imm) {
+            rex(false, 0, NONE, dst);
+            emit(0xb8 + (dst & 7));
+            dword(imm);
+        }
+
+        void mov64(Register dst, uint64_t imm) {
+            rex(true, 0, NONE, dst);
+            emit(0xb8 + (dst & 7));
+            qword(imm);
+        }
+
+        void mov64(Register dst, Register src) {
+            rex(true, src, NONE, dst);
+            emit(0x89);
+            direct(src, dst);
+        }
+
+        void alu(Alu op, Register dst, Register src) {
+            rex(false, src, NONE, dst);
+            emit(op << 3 | 0x1);
+            direct(src, dst);
+        }
+
+        void alu(Alu op, Register dst, uint32_t imm) {
+            rex(false, 0, NONE, dst);
+            emit(0x81);
+            direct(op, dst);
+            dword(imm);
+        }
+
+        void alu64(Alu op, Register dst, Register src) {
+            rex(true, src, NONE, dst);
+            emit(op << 3 | 0x1);
+            direct(src, dst);
+        }
+
+        void alu64(Alu op, Register dst, uint32_t imm) {
+            rex(true, 0, NONE, dst);
+            emit(0x81);
+            direct(op, dst);
+            dword(imm);
+        }
+
+        // dst op= qword [base + disp]
+        void alu64(Alu op, Register dst, Register base, int32_t disp) {
+            rex(true, dst, NONE, base);
+            emit(op << 3 | 0x3);
+            memory(dst, base, NONE, disp);
+        }
+
+        // qword [base + disp] op= imm
+        void alu64(Alu op, Register base, int32_t disp, uint32_t imm) {
+            rex(true, 0, NONE, base);
+            emit(0x81);
+            memory(op, base, NONE, disp);
+            dword(imm);
+        }
+
+        void cmp8(Register base, int32_t disp, uint8_t imm) {
+            rex(false, 0, NONE, base);
+            emit(0x80);
+            memory(CMP, base, NONE, disp);
+            emit(imm);
+        }
+
+        void load32(Register dst, Register base, int32_t disp) {
+            rex(false, dst, NONE, base);
+            emit(0x8b);
+            memory(dst, base, NONE, disp);
+        }
+
+        void store32(Register base, int32_t disp, Register src) {
+            rex(false, src, NONE, base);
+            emit(0x89);
+            memory(src, base, NONE, disp);
+        }
+
+        void load64(Register dst, Register base, int32_t disp) {
+            rex(true, dst, NONE, base);
+            emit(0x8b);
+            memory(dst, base, NONE, disp);
+        }
+
+        void store64(Register base, int32_t disp, Register src) {
+            rex(true, src, NONE, base);
+            emit(0x89);
+            memory(src, base, NONE, disp);
+        }
+
+        // Zero-extending byte load
+        void load8(Register dst, Register base, Register index, int32_t disp) {
+            rex(false, dst, index, base);
+            emit(0x0f);
+            emit(0xb6);
+            memory(dst, base, index, disp);
+        }
+
+        void store8(Register base, Register index, int32_t disp, Register src) {
+            rex(false, src, index, base, true);
+            emit(0x88);
+            memory(src, base, index, disp);
+        }
+
+        void store8(Register base, int32_t disp, uint8_t imm) {
+            rex(false, 0, NONE, base);
+            emit(0xc6);
+            memory(0, base, NONE, disp);
+            emit(imm);
+        }
+
+        void store16(Register base, int32_t disp, uint16_t imm) {
+            emit(0x66);
+            rex(false, 0, NONE, base);
+            emit(0xc7);
+            memory(0, base, NONE, disp);
+            emit(imm);
+            emit(imm >> 8);
+        }
+
+        // dst = low byte of src
+        void movzx8(Register dst, Register src) {
+            rex(false, dst, NONE, src, true);
+            emit(0x0f);
+            emit(0xb6);
+            direct(dst, src);
+        }
+
+        void shl(Register dst, uint8_t count) {
+            rex(false, 0, NONE, dst);
+            emit(0xc1);
+            direct(4, dst);
+            emit(count);
+        }
+
+        void shr(Register dst, uint8_t count) {
+            rex(false, 0, NONE, dst);
+            emit(0xc1);
+            direct(5, dst);
+            emit(count);
+        }
+
+        void test(Register a, Register b) {
+            rex(false, b, NONE, a);
+            emit(0x85);
+            direct(b, a);
+        }
+
+        void test64(Register a, Register b) {
+            rex(true, b, NONE, a);
+            emit(0x85);
+            direct(b, a);
+        }
+
+        void test(Register dst, uint32_t imm) {
+            rex(false, 0, NONE, dst);
+            emit(0xf7);
+            direct(0, dst);
+            dword(imm);
+        }
+
+        // Low byte of dst = condition
+        void set(Condition condition, Register dst) {
+            rex(false, 0, NONE, dst, true);
+            emit(0x0f);
+            emit(0x90 | condition);
+            direct(0, dst);
+        }
+
+        void push(Register r) {
+            rex(false, 0, NONE, r);
+            emit(0x50 + (r & 7));
+        }
+
+        void pop(Register r) {
+            rex(false, 0, NONE, r);
+            emit(0x58 + (r & 7));
+        }
+
+        void call(Register target) {
+            rex(false, 0, NONE, target);
+            emit(0xff);
+            direct(2, target);
+        }
+
+        void ret() {
+            emit(0xc3);
+        }
+
+        Label jump() {
+            emit(0xe9);
+            dword(0);
+            return here();
+        }
+
+        Label jump(Condition condition) {
+            emit(0x0f);
+            emit(0x80 | condition);
+            dword(0);
+            return here();
+        }
+
+        void bind(Label label) {
+            bind(label, here());
+        }
+
+        void bind(Label label, size_t target) {
+            int32_t rel = (int32_t)(target - label);
+            std::memcpy(&bytes[label - 4], &rel, sizeof(rel));
+        }
+
+    private:
+        void emit(uint8_t byte) {
+            bytes.push_back(byte);
+        }
+
+        void dword(uint32_t value) {
+            for (int i = 0; i < 4; i++) emit(value >> (i * 8));
+        }
+
+        void qword(uint64_t value) {
+            for (int i = 0; i < 8; i++) emit(value >> (i * 8));
+        }
+
+        // Byte operations need a prefix to reach spl/bpl/sil/dil instead of ah/ch/dh/bh
+        void rex(bool wide, uint8_t reg, uint8_t index, uint8_t base, bool byteRegisters=false) {
+            uint8_t prefix = 0x40 | wide << 3 | (reg >> 3 & 1) << 2 | (base >> 3 & 1);
+            if (index != NONE) prefix |= (index >> 3 & 1) << 1;
+
+            if (prefix != 0x40 || byteRegisters) emit(prefix);
+        }
+
+        void direct(uint8_t reg, uint8_t rm) {
+            emit(0xc0 | (reg & 7) << 3 | (rm & 7));
+        }
+
+        // Always the disp32 form, rsp and r12 as a base need a SIB byte
+        void memory(uint8_t reg, uint8_t base, uint8_t index, int32_t disp) {
+            if (index == NONE && (base & 7) != RSP) {
+                emit(0x80 | (reg & 7) << 3 | (base & 7));
+            } else {
+                emit(0x80 | (reg & 7) << 3 | RSP);
+                emit(((index == NONE ? (uint8_t)RSP : index) & 7) << 3 | (base & 7));
+            }
+            dword(disp);
+        }
+};
+
+// Executable memory compiled blocks are copied into
+class CodeBuffer {
+    uint8_t* base = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+
+    public:
+        explicit CodeBuffer(size_t capacity) {
+            void* memory = mmap(nullptr, capacity, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) return;
+
+            base = (uint8_t*)memory;
+            this->capacity = capacity;
+        }
+
+        CodeBuffer(const CodeBuffer&) = delete;
+        CodeBuffer& operator=(const CodeBuffer&) = delete;
+
+        ~CodeBuffer() {
+            if (base != nullptr) munmap(base, capacity);
+        }
+
+        bool valid() const {
+            return base != nullptr;
+        }
+
+        // Null when full
+        void* place(const std::vector<uint8_t>& code) {
+            if (capacity - used < code.size()) return nullptr;
+
+            uint8_t* start = base + used;
+            std::memcpy(start, code.data(), code.size());
+            used = (used + code.size() + 15) & ~(size_t)15;
+            return start;
+        }
+
+        void clear() {
+            used = 0;
+        }
+};
+
+template <typename CPU>
+class Jit : public CodeCache {
+    using A = Assembler;
+    using NativeCode = void (*)(CPU*);
+
+    struct Entry {
+        NativeCode code = nullptr;
+        uint16_t runs = 0;
+
+        // Starts with an instruction the recompiler does not handle
+        bool interpreted = false;
+    };
+
+    using EntryPage = std::array<Entry, 0x100>;
+
+    // Runs through the interpreter before a block is worth compiling
+    static constexpr uint16_t HOT = JIT_HOT;
+
+    static constexpr size_t MAX_BLOCK = 32;
+    static constexpr size_t BUFFER_SIZE = 16 << 20;
+
+    // Bits of P, the same as the CPU's flags
+    enum : uint8_t {
+        P_CARRY = 0x1,
+        P_ZERO = 0x2,
+        P_INTERRUPT = 0x4,
+        P_DECIMAL = 0x8,
+        P_OVERFLOW = 0x40,
+        P_NEGATIVE = 0x80
+    };
+
+    static constexpr A::Register REG_A = A::RBX, REG_X = A::RBP, REG_Y = A::R15, REG_P = A::R13;
+    static constexpr A::Register CYCLES = A::R14, CONTEXT = A::R12;
+
+    static_assert(sizeof(Page) == 32, "page table lookups shift by 5");
+
+    CPU& cpu;
+    CodeBuffer buffer{BUFFER_SIZE};
+    std::array<std::unique_ptr<EntryPage>, 0x100> pages;
+
+    std::FILE* perfMap = nullptr;
+
+    // Where the CPU's fields are, relative to the CPU
+    int32_t accumulatorAt, xAt, yAt, spAt, flagsAt, nValueAt, zValueAt, instrRegAt, fetchedAt, pcAt;
+    int32_t cyclesAt, instructionsAt, runLimitAt, interruptsAt, changedAt;
+
+    // State after the instructions of a block so far, written back on the way out
+    struct Exit {
+        std::vector<A::Label> jumps;
+        uint16_t pc;
+        uint32_t instructions;
+        uint8_t opcode;
+        uint16_t operand;
+    };
+
+    public:
+        Jit(CPU& cpu, bool writePerfMap) : cpu(cpu) {
+            accumulatorAt = offset(&cpu.accumulator);
+            xAt = offset(&cpu.x);
+            yAt = offset(&cpu.y);
+            spAt = offset(&cpu.sp);
+            flagsAt = offset(&cpu.flags);
+            nValueAt = offset(&cpu.nValue);
+            zValueAt = offset(&cpu.zValue);
+            instrRegAt = offset(&cpu.instr_reg);
+            fetchedAt = offset(&cpu.fetched);
+            pcAt = offset(&cpu.pc);
+            cyclesAt = offset(&cpu.cycles);
+            instructionsAt = offset(&cpu.instructions);
+            runLimitAt = offset(&cpu.runLimit);
+            interruptsAt = offset(&cpu.interrupts.lines());
+            changedAt = offset(&cpu.decodeCache.changed);
+
+            if (writePerfMap && buffer.valid()) {
+                std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+                perfMap = std::fopen(path.c_str(), "a");
+            }
+        }
+
+        Jit(const Jit&) = delete;
+        Jit& operator=(const Jit&) = delete;
+
+        ~Jit() {
+            if (perfMap != nullptr) std::fclose(perfMap);
+        }
+
+        bool available() const {
+            return buffer.valid();
+        }
+
+        void invalidate(uint8_t page) override {
+            if (pages[page] != nullptr) pages[page]->fill({});
+        }
+
+        // Native code for the block at pc, null while it should be interpreted
+        NativeCode lookup(uint16_t pc) {
+            if (cpu.bus.pages[pc >> 8].read == nullptr) return nullptr;
+
+            auto& page = pages[pc >> 8];
+            if (page == nullptr) page = std::make_unique<EntryPage>();
+
+            Entry& entry = (*page)[pc & 0xff];
+            if (entry.code != nullptr || entry.interpreted || ++entry.runs < HOT) return entry.code;
+
+            entry.code = compile(pc);
+            entry.interpreted = entry.code == nullptr;
+            return entry.code;
+        }
+
+    private:
+        int32_t offset(const void* field) const {
+            return (const uint8_t*)field - (const uint8_t*)&cpu;
+        }
+
+        static uint8_t readMemory(CPU* cpu, uint32_t address) {
+            return cpu->bus.read(address);
+        }
+
+        static void writeMemory(CPU* cpu, uint32_t address, uint32_t value) {
+            cpu->bus.write(address, value);
+        }
+
+        // The modes effectiveAddress() computes, plus immediate operands
+        static bool addressable(AddressingMode mode) {
+            switch (mode) {
+                case IMMEDIATE:
+                case ZERO_PAGE: case ZERO_PAGE_X: case ZERO_PAGE_Y:
+                case ABSOLUTE: case ABSOLUTE_X: case ABSOLUTE_Y:
+                case INDIRECT_INDEXED:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        // Whether the recompiler handles this instruction at this address
+        static bool compilable(const Opcode& opcode, uint16_t operand, uint16_t address) {
+            using I = Instruction;
+
+            switch (opcode.instruction) {
+                case I::LDA: case I::LDX: case I::LDY:
+                case I::AND: case I::ORA: case I::EOR:
+                case I::CMP: case I::CPX: case I::CPY:
+                case I::STA: case I::STX: case I::STY:
+                case I::INC: case I::DEC:
+                    return addressable(opcode.mode);
+                case I::INX: case I::INY: case I::DEX: case I::DEY:
+                case I::TAX: case I::TAY: case I::TXA: case I::TYA: case I::TXS: case I::TSX:
+                case I::CLC: case I::SEC: case I::CLI: case I::SEI: case I::CLD: case I::SED: case I::CLV:
+                    return true;
+                // Undocumented and 65C02 NOPs with an operand still read it
+                case I::NOP:
+                    return opcode.mode == IMPLIED;
+                // Loops to themselves are left to the interpreter, which may stop on them
+                case I::BCC: case I::BCS: case I::BEQ: case I::BMI:
+                case I::BNE: case I::BPL: case I::BVC: case I::BVS:
+                    return operand != 0;
+                case I::JMP:
+                    return opcode.mode == ABSOLUTE && operand != address;
+                default:
+                    return false;
+            }
+        }
+
+        NativeCode compile(uint16_t pc) {
+            const uint8_t* host = cpu.bus.pages[pc >> 8].read;
+
+            // The first write to the page drops what is compiled from it
+            cpu.bus.watchCode(pc >> 8);
+
+            A as;
+            std::vector<Exit> exits;
+
+            prologue(as);
+
+            unsigned offset = pc & 0xff;
+            uint16_t address = pc;
+            uint32_t count = 0;
+            bool wrote = false;
+            bool ended = false;
+
+            uint8_t lastCode = 0;
+            uint16_t lastOperand = 0;
+
+            while (count < MAX_BLOCK && offset < 0x100) {
+                uint8_t code = host[offset];
+                const Opcode& opcode = CPU::opcodes[code];
+                if (offset + opcode.length > 0x100) break;
+
+                uint16_t operand = 0;
+                if (opcode.length == 2) operand = host[offset + 1];
+                if (opcode.length == 3) operand = (uint16_t)host[offset + 1] << 8 | host[offset + 2];
+
+                if (!compilable(opcode, operand, address)) break;
+
+                // Leave where the interpreter would look at something between instructions
+                if (count > 0) {
+                    Exit& exit = addExit(exits, address, count, lastCode, lastOperand);
+
+                    as.alu64(A::CMP, CYCLES, CONTEXT, runLimitAt);
+                    exit.jumps.push_back(as.jump(A::ABOVE_EQUAL));
+
+                    as.load32(A::RAX, CONTEXT, interruptsAt);
+                    as.test(A::RAX, A::RAX);
+                    exit.jumps.push_back(as.jump(A::NOT_EQUAL));
+
+                    if (wrote) {
+                        as.cmp8(CONTEXT, changedAt, 0);
+                        exit.jumps.push_back(as.jump(A::NOT_EQUAL));
+                    }
+                }
+
+                if (changesPC(opcode.instruction)) {
+                    transfer(as, exits, opcode, operand, address, count + 1, code);
+                    count++;
+                    ended = true;
+                    break;
+                }
+
+                wrote = instruction(as, opcode, operand);
+                as.alu64(A::ADD, CYCLES, (uint32_t)opcode.cycles);
+
+                lastCode = code;
+                lastOperand = operand;
+                address += opcode.length;
+                offset += opcode.length;
+                count++;
+            }
+
+            if (count == 0) return nullptr;
+
+            if (!ended) {
+                Exit& exit = addExit(exits, address, count, lastCode, lastOperand);
+                exit.jumps.push_back(as.jump());
+            }
+
+            size_t epilogueAt = emitEpilogue(as);
+
+            for (const Exit& exit: exits) {
+                for (A::Label jump: exit.jumps) as.bind(jump);
+
+                as.store16(CONTEXT, pcAt, exit.pc);
+                as.alu64(A::ADD, CONTEXT, instructionsAt, exit.instructions);
+                as.store8(CONTEXT, instrRegAt, exit.opcode);
+                as.store16(CONTEXT, fetchedAt, exit.operand);
+                as.bind(as.jump(), epilogueAt);
+            }
+
+            void* native = buffer.place(as.bytes);
+            if (native == nullptr) {
+                // Full: start over, nothing compiled is running between blocks
+                buffer.clear();
+                for (auto& page: pages) {
+                    if (page != nullptr) page->fill({});
+                }
+                native = buffer.place(as.bytes);
+                if (native == nullptr) return nullptr;
+            }
+
+            if (perfMap != nullptr) {
+                std::fprintf(perfMap, "%lx %zx 6502_%04x\n", (unsigned long)native, as.bytes.size(), pc);
+                std::fflush(perfMap);
+            }
+
+            return (NativeCode)native;
+        }
+
+        static Exit& addExit(std::vector<Exit>& exits, uint16_t pc, uint32_t instructions, uint8_t opcode, uint16_t operand) {
+            exits.push_back({{}, pc, instructions, opcode, operand});
+            return exits.back();
+        }
+
+        void prologue(A& as) {
+            // Six pushes and the return address leave the stack 8 off alignment,
+            // the slot that fixes it is scratch space
+            as.push(A::RBX);
+            as.push(A::RBP);
+            as.push(A::R12);
+            as.push(A::R13);
+            as.push(A::R14);
+            as.push(A::R15);
+            as.alu64(A::SUB, A::RSP, 8u);
+
+            as.mov64(CONTEXT, A::RDI);
+            as.load8(REG_A, CONTEXT, A::NONE, accumulatorAt);
+            as.load8(REG_X, CONTEXT, A::NONE, xAt);
+            as.load8(REG_Y, CONTEXT, A::NONE, yAt);
+
+            // P is kept whole in a register, put together from the CPU's lazy N and Z
+            as.load8(REG_P, CONTEXT, A::NONE, flagsAt);
+            as.load8(A::RAX, CONTEXT, A::NONE, nValueAt);
+            as.alu(A::AND, A::RAX, 0x80u);
+            as.alu(A::OR, REG_P, A::RAX);
+            as.load8(A::RAX, CONTEXT, A::NONE, zValueAt);
+            as.test(A::RAX, A::RAX);
+            as.set(A::EQUAL, A::RAX);
+            as.shl(A::RAX, 1);
+            as.alu(A::OR, REG_P, A::RAX);
+
+            as.load64(CYCLES, CONTEXT, cyclesAt);
+        }
+
+        size_t emitEpilogue(A& as) {
+            size_t start = as.here();
+
+            as.store8(CONTEXT, A::NONE, accumulatorAt, REG_A);
+            as.store8(CONTEXT, A::NONE, xAt, REG_X);
+            as.store8(CONTEXT, A::NONE, yAt, REG_Y);
+            as.store8(CONTEXT, A::NONE, nValueAt, REG_P);
+            as.mov(A::RAX, REG_P);
+            as.alu(A::AND, A::RAX, 0x7du);
+            as.store8(CONTEXT, A::NONE, flagsAt, A::RAX);
+            as.mov(A::RAX, REG_P);
+            as.alu(A::XOR, A::RAX, 0x02u);
+            as.alu(A::AND, A::RAX, 0x02u);
+            as.store8(CONTEXT, A::NONE, zValueAt, A::RAX);
+            as.store64(CONTEXT, cyclesAt, CYCLES);
+
+            as.alu64(A::ADD, A::RSP, 8u);
+            as.pop(A::R15);
+            as.pop(A::R14);
+            as.pop(A::R13);
+            as.pop(A::R12);
+            as.pop(A::RBP);
+            as.pop(A::RBX);
+            as.ret();
+
+            return start;
+        }
+
+        // Calls fn(cpu, esi, edx) with the cycle count up to date for devices
+        void callOut(A& as, const void* fn) {
+            as.store64(CONTEXT, cyclesAt, CYCLES);
+            as.mov64(A::RDI, CONTEXT);
+            as.mov64(A::RAX, (uint64_t)fn);
+            as.call(A::RAX);
+        }
+
+        // ecx = byte at the address in edx
+        void read(A& as) {
+            as.mov(A::RAX, A::RDX);
+            as.shr(A::RAX, 8);
+            as.shl(A::RAX, 5);
+            as.mov64(A::RCX, (uint64_t)&cpu.bus.pages[0].read);
+            as.alu64(A::ADD, A::RAX, A::RCX);
+            as.load64(A::RAX, A::RAX, 0);
+            as.test64(A::RAX, A::RAX);
+            A::Label slow = as.jump(A::EQUAL);
+
+            as.movzx8(A::RSI, A::RDX);
+            as.load8(A::RCX, A::RAX, A::RSI, 0);
+            A::Label done = as.jump();
+
+            as.bind(slow);
+            as.mov(A::RSI, A::RDX);
+            callOut(as, (const void*)&readMemory);
+            as.movzx8(A::RCX, A::RAX);
+
+            as.bind(done);
+        }
+
+        // Stores ecx at the address in edx
+        void write(A& as) {
+            as.mov(A::RAX, A::RDX);
+            as.shr(A::RAX, 8);
+            as.shl(A::RAX, 5);
+            as.mov64(A::RSI, (uint64_t)&cpu.bus.pages[0].write);
+            as.alu64(A::ADD, A::RAX, A::RSI);
+            as.load64(A::RAX, A::RAX, 0);
+            as.test64(A::RAX, A::RAX);
+            A::Label slow = as.jump(A::EQUAL);
+
+            as.movzx8(A::RSI, A::RDX);
+            as.store8(A::RAX, A::RSI, 0, A::RCX);
+            A::Label done = as.jump();
+
+            as.bind(slow);
+            as.mov(A::RSI, A::RDX);
+            as.mov(A::RDX, A::RCX);
+            callOut(as, (const void*)&writeMemory);
+
+            as.bind(done);
+        }
+
+        // edx = (edx + index) masked to 8 or 16 bits
+        static void addIndex(A& as, A::Register index, uint32_t mask) {
+            as.alu(A::ADD, A::RDX, index);
+            as.alu(A::AND, A::RDX, mask);
+        }
+
+        // One extra cycle when edx is on another page than base (in eax)
+        void crossing(A& as) {
+            as.alu(A::XOR, A::RAX, A::RDX);
+            as.alu(A::CMP, A::RAX, 0xffu);
+            as.set(A::ABOVE, A::RAX);
+            as.movzx8(A::RAX, A::RAX);
+            as.alu64(A::ADD, CYCLES, A::RAX);
+        }
+
+        // edx = effective address, charging page crossings for reads like operand<mode>() does
+        void effectiveAddress(A& as, AddressingMode mode, uint16_t operand, bool charge) {
+            switch (mode) {
+                case ZERO_PAGE:
+                case ABSOLUTE:
+                    as.mov(A::RDX, (uint32_t)operand);
+                    break;
+                case ZERO_PAGE_X:
+                case ZERO_PAGE_Y:
+                    as.mov(A::RDX, (uint32_t)operand);
+                    addIndex(as, mode == ZERO_PAGE_X ? REG_X : REG_Y, 0xff);
+                    break;
+                case ABSOLUTE_X:
+                case ABSOLUTE_Y:
+                    as.mov(A::RDX, (uint32_t)operand);
+                    addIndex(as, mode == ABSOLUTE_X ? REG_X : REG_Y, 0xffff);
+                    if (charge) {
+                        as.mov(A::RAX, (uint32_t)operand);
+                        crossing(as);
+                    }
+                    break;
+                case INDIRECT_INDEXED:
+                    // Pointer in the zero page, the high byte wraps within it
+                    as.mov(A::RDX, (uint32_t)(operand & 0xff));
+                    read(as);
+                    as.store32(A::RSP, 0, A::RCX);
+                    as.mov(A::RDX, (uint32_t)((operand + 1) & 0xff));
+                    read(as);
+                    as.shl(A::RCX, 8);
+                    as.load32(A::RDX, A::RSP, 0);
+                    as.alu(A::OR, A::RDX, A::RCX);
+                    as.mov(A::RAX, A::RDX);
+                    addIndex(as, REG_Y, 0xffff);
+                    if (charge) crossing(as);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        // ecx = operand value
+        void load(A& as, AddressingMode mode, uint16_t operand) {
+            if (mode == IMMEDIATE) {
+                as.mov(A::RCX, (uint32_t)(operand & 0xff));
+                return;
+            }
+
+            effectiveAddress(as, mode, operand, true);
+            read(as);
+        }
+
+        void setN(A& as, A::Register value) {
+            as.alu(A::AND, REG_P, (uint32_t)(uint8_t)~P_NEGATIVE);
+            as.mov(A::RAX, value);
+            as.alu(A::AND, A::RAX, (uint32_t)P_NEGATIVE);
+            as.alu(A::OR, REG_P, A::RAX);
+        }
+
+        void setZ(A& as, A::Register value) {
+            as.alu(A::AND, REG_P, (uint32_t)(uint8_t)~P_ZERO);
+            as.test(value, value);
+            as.set(A::EQUAL, A::RAX);
+            as.movzx8(A::RAX, A::RAX);
+            as.alu(A::ADD, A::RAX, A::RAX);
+            as.alu(A::OR, REG_P, A::RAX);
+        }
+
+        void setNZ(A& as, A::Register value) {
+            setN(as, value);
+            setZ(as, value);
+        }
+
+        void setFlag(A& as, uint8_t flag, bool on) {
+            if (on) as.alu(A::OR, REG_P, (uint32_t)flag);
+            else as.alu(A::AND, REG_P, (uint32_t)(uint8_t)~flag);
+        }
+
+        // Everything but control transfer. True if it may have written memory.
+        bool instruction(A& as, const Opcode& opcode, uint16_t operand) {
+            using I = Instruction;
+
+            switch (opcode.instruction) {
+                case I::LDA: case I::LDX: case I::LDY: {
+                    A::Register target = opcode.instruction == I::LDA ? REG_A : opcode.instruction == I::LDX ? REG_X : REG_Y;
+                    load(as, opcode.mode, operand);
+                    as.mov(target, A::RCX);
+                    setNZ(as, target);
+                    return false;
+                }
+                case I::AND: case I::ORA: case I::EOR:
+                    load(as, opcode.mode, operand);
+                    as.alu(opcode.instruction == I::AND ? A::AND : opcode.instruction == I::ORA ? A::OR : A::XOR, REG_A, A::RCX);
+                    setNZ(as, REG_A);
+                    return false;
+                case I::CMP: case I::CPX: case I::CPY: {
+                    A::Register source = opcode.instruction == I::CMP ? REG_A : opcode.instruction == I::CPX ? REG_X : REG_Y;
+                    load(as, opcode.mode, operand);
+
+                    // CMP and CPX set carry on greater than, CPY on greater or equal
+                    as.alu(A::AND, REG_P, (uint32_t)(uint8_t)~P_CARRY);
+                    as.alu(A::CMP, source, A::RCX);
+                    as.set(opcode.instruction == I::CPY ? A::ABOVE_EQUAL : A::ABOVE, A::RAX);
+                    as.movzx8(A::RAX, A::RAX);
+                    as.alu(A::OR, REG_P, A::RAX);
+
+                    as.mov(A::RDX, source);
+                    as.alu(A::SUB, A::RDX, A::RCX);
+                    as.alu(A::AND, A::RDX, 0xffu);
+                    setNZ(as, A::RDX);
+                    return false;
+                }
+                case I::STA: case I::STX: case I::STY: {
+                    A::Register source = opcode.instruction == I::STA ? REG_A : opcode.instruction == I::STX ? REG_X : REG_Y;
+                    effectiveAddress(as, opcode.mode, operand, false);
+                    as.mov(A::RCX, source);
+                    write(as);
+                    return true;
+                }
+                case I::INC: case I::DEC:
+                    // Read, write the old value back (read it again on the 65C02), write
+                    // the result, as the interpreter does. The value waits in the scratch
+                    // slot while the bus is called.
+                    effectiveAddress(as, opcode.mode, operand, false);
+                    read(as);
+                    as.store32(A::RSP, 0, A::RCX);
+                    effectiveAddress(as, opcode.mode, operand, false);
+                    if constexpr (CPU::cmos) read(as);
+                    else write(as);
+
+                    as.load32(A::RCX, A::RSP, 0);
+                    as.alu(opcode.instruction == I::INC ? A::ADD : A::SUB, A::RCX, 1u);
+                    as.alu(A::AND, A::RCX, 0xffu);
+                    as.store32(A::RSP, 0, A::RCX);
+                    effectiveAddress(as, opcode.mode, operand, false);
+                    write(as);
+
+                    as.load32(A::RCX, A::RSP, 0);
+                    setNZ(as, A::RCX);
+                    return true;
+                case I::INX: case I::INY: case I::DEX: case I::DEY: {
+                    A::Register target = opcode.instruction == I::INX || opcode.instruction == I::DEX ? REG_X : REG_Y;
+                    as.alu(opcode.instruction == I::INX || opcode.instruction == I::INY ? A::ADD : A::SUB, target, 1u);
+                    as.alu(A::AND, target, 0xffu);
+                    setNZ(as, target);
+                    return false;
+                }
+                case I::TAX: as.mov(REG_X, REG_A); setNZ(as, REG_X); return false;
+                case I::TAY: as.mov(REG_Y, REG_A); setNZ(as, REG_Y); return false;
+                case I::TXA: as.mov(REG_A, REG_X); setNZ(as, REG_A); return false;
+                case I::TYA: as.mov(REG_A, REG_Y); setNZ(as, REG_A); return false;
+                // TSX behaves like TXS in this emulator
+                case I::TXS: case I::TSX: as.store8(CONTEXT, A::NONE, spAt, REG_X); return false;
+                case I::CLC: setFlag(as, P_CARRY, false); return false;
+                case I::SEC: setFlag(as, P_CARRY, true); return false;
+                case I::CLI: setFlag(as, P_INTERRUPT, false); return false;
+                case I::SEI: setFlag(as, P_INTERRUPT, true); return false;
+                case I::CLD: setFlag(as, P_DECIMAL, false); return false;
+                case I::SED: setFlag(as, P_DECIMAL, true); return false;
+                case I::CLV: setFlag(as, P_OVERFLOW, false); return false;
+                default: return false;
+            }
+        }
+
+        // Branch or JMP ending the block, instructions counts it
+        void transfer(A& as, std::vector<Exit>& exits, const Opcode& opcode, uint16_t operand, uint16_t address,
+            uint32_t instructions, uint8_t code) {
+            using I = Instruction;
+
+            if (opcode.instruction == I::JMP) {
+                as.alu64(A::ADD, CYCLES, (uint32_t)opcode.cycles);
+                addExit(exits, operand, instructions, code, operand).jumps.push_back(as.jump());
+                return;
+            }
+
+            uint8_t flag = 0;
+            bool whenSet = false;
+            switch (opcode.instruction) {
+                case I::BCC: flag = P_CARRY; break;
+                case I::BCS: flag = P_CARRY; whenSet = true; break;
+                case I::BNE: flag = P_ZERO; break;
+                case I::BEQ: flag = P_ZERO; whenSet = true; break;
+                case I::BPL: flag = P_NEGATIVE; break;
+                case I::BMI: flag = P_NEGATIVE; whenSet = true; break;
+                case I::BVC: flag = P_OVERFLOW; break;
+                case I::BVS: flag = P_OVERFLOW; whenSet = true; break;
+                default: break;
+            }
+
+            // Relative to the branch's own address, like branch()
+            uint16_t next = address + 2;
+            uint16_t target = address + (int8_t)operand;
+            uint32_t taken = opcode.cycles + 1 + ((next ^ target) > 0xff);
+
+            as.test(REG_P, (uint32_t)flag);
+            A::Label skip = as.jump(whenSet ? A::EQUAL : A::NOT_EQUAL);
+
+            as.alu64(A::ADD, CYCLES, taken);
+            addExit(exits, target, instructions, code, operand).jumps.push_back(as.jump());
+
+            as.bind(skip);
+            as.alu64(A::ADD, CYCLES, (uint32_t)opcode.cycles);
+            addExit(exits, next, instructions, code, operand).jumps.push_back(as.jump());
+        }
+};
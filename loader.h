@@ -0,0 +1,301 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bus.h"
+
+/*
+ROM images. A spec names a file and where it goes:
+    path[@ADDR][,ro]
+    - raw binaries load at ADDR (hex, default 0)
+    - *.hex / *.ihx files are Intel HEX and carry their own addresses
+    - ",ro" maps the image read-only: fully covered pages point straight into
+      the mapped file (no copy), writes to them are dropped
+Files are mmap'd. An Image can be loaded into any number of buses and stays
+alive as long as one of them uses it.
+*/
+
+struct Segment {
+    uint16_t address;
+    const uint8_t* data;
+    size_t size;
+};
+
+class MappedFile {
+    void* data = MAP_FAILED;
+    size_t length = 0;
+
+    public:
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        MappedFile() = default;
+
+        ~MappedFile() {
+            if (data != MAP_FAILED) munmap(data, length);
+        }
+
+        bool open(const std::string& path) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+
+            struct stat info;
+            bool ok = fstat(fd, &info) == 0;
+
+            // An empty file is valid but cannot be mapped
+            if (ok && info.st_size > 0) {
+                length = info.st_size;
+                data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                ok = data != MAP_FAILED;
+            }
+            ::close(fd);
+
+            return ok;
+        }
+
+        const uint8_t* bytes() const {
+            return data != MAP_FAILED ? (const uint8_t*)data : nullptr;
+        }
+
+        size_t size() const {
+            return length;
+        }
+};
+
+class Image {
+    MappedFile file;
+
+    // Intel HEX data decoded out of the text
+    std::vector<uint8_t> decoded;
+
+    public:
+        std::string path;
+        std::vector<Segment> segments;
+        bool readOnly = false;
+
+        static std::shared_ptr<Image> open(const std::string& spec, std::string& error) {
+            auto image = std::make_shared<Image>();
+
+            std::string path = spec;
+            uint32_t address = 0;
+
+            if (path.size() > 3 && path.compare(path.size() - 3, 3, ",ro") == 0) {
+                image->readOnly = true;
+                path.erase(path.size() - 3);
+            }
+
+            size_t at = path.rfind('@');
+            if (at != std::string::npos) {
+                char* end;
+                address = std::strtoul(path.c_str() + at + 1, &end, 16);
+                if (*end != '\0' || at + 1 == path.size() || address > 0xffff) {
+                    error = "bad load address in " + spec;
+                    return nullptr;
+                }
+                path.erase(at);
+            }
+
+            image->path = path;
+            if (!image->file.open(path)) {
+                error = "cannot open " + path;
+                return nullptr;
+            }
+
+            if (isIntelHex(path)) {
+                if (at != std::string::npos) {
+                    error = path + ": Intel HEX files carry their own addresses";
+                    return nullptr;
+                }
+                if (!image->parseIntelHex(error)) return nullptr;
+            } else {
+                // Anything past the end of the address space is cut off
+                size_t size = std::min(image->file.size(), (size_t)0x10000 - address);
+                if (size > 0) image->segments.push_back({(uint16_t)address, image->file.bytes(), size});
+            }
+
+            return image;
+        }
+
+        // The bus keeps the image alive while its pages point into it
+        static void load(const std::shared_ptr<Image>& image, Bus& bus) {
+            for (const Segment& segment: image->segments) {
+                if (image->readOnly) loadROM(bus, segment);
+                else loadRAM(bus, segment);
+            }
+
+            if (image->readOnly) bus.backing.push_back(image);
+        }
+
+    private:
+        static bool isIntelHex(const std::string& path) {
+            for (const char* extension: {".hex", ".ihx"}) {
+                size_t length = std::strlen(extension);
+                if (path.size() > length && path.compare(path.size() - length, length, extension) == 0) return true;
+            }
+            return false;
+        }
+
+        static void loadRAM(Bus& bus, const Segment& segment) {
+            uint32_t address = segment.address;
+            uint32_t end = address + segment.size;
+
+            while (address < end) {
+                uint32_t pageEnd = std::min((address | 0xff) + 1, end);
+                Page& page = bus.pages[address >> 8];
+
+                if (page.write == &bus.memory[address & 0xff00]) {
+                    std::memcpy(&bus.memory[address], segment.data + (address - segment.address), pageEnd - address);
+                } else {
+                    // ROM or device page, go through the bus like a CPU write would
+                    for (uint32_t i = address; i < pageEnd; i++) {
+                        bus.write(i, segment.data[i - segment.address]);
+                    }
+                }
+
+                address = pageEnd;
+            }
+        }
+
+        static void loadROM(Bus& bus, const Segment& segment) {
+            uint32_t address = segment.address;
+            uint32_t end = address + segment.size;
+
+            while (address < end) {
+                uint32_t pageStart = address & 0xff00;
+                uint32_t pageEnd = std::min(pageStart + 0x100, end);
+                uint8_t page = address >> 8;
+
+                if (address == pageStart && pageEnd == pageStart + 0x100) {
+                    // Whole page covered, no copy at all
+                    bus.mapPage(page, const_cast<uint8_t*>(segment.data + (address - segment.address)), false);
+                } else {
+                    // Partly covered, keep whatever the rest of the page held
+                    uint8_t* host = &bus.memory[pageStart];
+                    if (bus.pages[page].read != nullptr && bus.pages[page].read != host) {
+                        std::memcpy(host, bus.pages[page].read, 0x100);
+                    }
+
+                    std::memcpy(&bus.memory[address], segment.data + (address - segment.address), pageEnd - address);
+                    bus.mapPage(page, host, false);
+                }
+
+                address = pageEnd;
+            }
+        }
+
+        static int hexValue(char c) {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            return -1;
+        }
+
+        bool parseIntelHex(std::string& error) {
+            const char* text = (const char*)file.bytes();
+            size_t size = file.size();
+
+            // Data is collected first so segment pointers stay valid
+            struct Record {
+                uint32_t address;
+                size_t offset;
+                size_t size;
+            };
+            std::vector<Record> records;
+
+            uint32_t base = 0;
+            size_t line = 0;
+            size_t i = 0;
+            bool ended = false;
+
+            while (i < size && !ended) {
+                size_t lineEnd = i;
+                while (lineEnd < size && text[lineEnd] != '\n') lineEnd++;
+                line++;
+
+                size_t length = lineEnd - i;
+                while (length > 0 && (text[i + length - 1] == '\r' || text[i + length - 1] == ' ')) length--;
+
+                if (length > 0) {
+                    const char* record = text + i;
+                    std::vector<uint8_t> bytes;
+
+                    bool valid = record[0] == ':' && length % 2 == 1 && length >= 11;
+                    for (size_t j = 1; valid && j < length; j += 2) {
+                        int high = hexValue(record[j]), low = hexValue(record[j + 1]);
+                        if (high < 0 || low < 0) valid = false;
+                        else bytes.push_back(high << 4 | low);
+                    }
+
+                    uint8_t checksum = 0;
+                    for (uint8_t byte: bytes) checksum += byte;
+
+                    if (!valid || bytes.size() != bytes[0] + 5u || checksum != 0) {
+                        error = path + ": bad record on line " + std::to_string(line);
+                        return false;
+                    }
+
+                    uint8_t count = bytes[0];
+                    uint32_t address = base + (bytes[1] << 8 | bytes[2]);
+
+                    // End of file carries no data, segment and linear address records two bytes
+                    bool sized = true;
+                    if (bytes[3] == 0x01) sized = count == 0;
+                    if (bytes[3] == 0x02 || bytes[3] == 0x04) sized = count == 2;
+                    if (!sized) {
+                        error = path + ": bad record length on line " + std::to_string(line);
+                        return false;
+                    }
+
+                    switch (bytes[3]) {
+                        case 0x00:
+                            if (address + count > 0x10000) {
+                                error = path + ": data outside the 64 KB address space on line " + std::to_string(line);
+                                return false;
+                            }
+                            records.push_back({address, decoded.size(), count});
+                            decoded.insert(decoded.end(), bytes.begin() + 4, bytes.begin() + 4 + count);
+                            break;
+                        case 0x01:
+                            ended = true;
+                            break;
+                        case 0x02:
+                            base = (bytes[4] << 8 | bytes[5]) << 4;
+                            break;
+                        case 0x04:
+                            base = (bytes[4] << 8 | bytes[5]) << 16;
+                            break;
+                        default:
+                            // Start address records mean nothing here, reset comes from the vector
+                            break;
+                    }
+                }
+
+                i = lineEnd + 1;
+            }
+
+            // Adjacent records become one segment, so ROM pages can be mapped without copying
+            for (const Record& record: records) {
+                if (!segments.empty()) {
+                    Segment& last = segments.back();
+                    if (last.address + last.size == record.address && last.data + last.size == decoded.data() + record.offset) {
+                        last.size += record.size;
+                        continue;
+                    }
+                }
+                segments.push_back({(uint16_t)record.address, decoded.data() + record.offset, record.size});
+            }
+
+            return true;
+        }
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <string>
+#include <utility>
+
+#include "bus.h"
+#include "cpu.h"
+#include "replay.h"
+#include "snapshot.h"
+
+// One independent emulated machine. Nothing is shared between machines,
+// so any number of them can run side by side on different threads.
+template <typename Trace=NoTrace, Variant variant=Variant::NMOS>
+class Machine {
+    public:
+        Bus bus;
+        CPU<Trace, variant> cpu;
+
+        template <typename... Args>
+        explicit Machine(Args&&... args) : cpu(bus, std::forward<Args>(args)...) {}
+
+        Machine(const Machine&) = delete;
+        Machine& operator=(const Machine&) = delete;
+
+        // Maps the device and lets it hook into the scheduler and interrupt lines
+        void addPeripheral(Peripheral* peripheral) {
+            bus.addPeripheral(peripheral);
+            peripheral->attach(cpu.scheduler, cpu.interrupts);
+        }
+
+        // Logs device reads and interrupts from here on, to path if not empty
+        bool record(InputLog& log, const std::string& path, std::string& error) {
+            if (!log.record(cpu.cycles, path, error)) return false;
+
+            attach(log);
+            return true;
+        }
+
+        // Feeds a loaded log back. The machine must be in the state the
+        // recording started from, e.g. reset or restored from a checkpoint.
+        void replay(InputLog& log) {
+            attach(log);
+            log.replay(cpu.cycles);
+        }
+
+        Snapshot snapshot() {
+            Snapshot snapshot;
+
+            snapshot.accumulator = cpu.accumulator;
+            snapshot.x = cpu.x;
+            snapshot.y = cpu.y;
+            snapshot.sp = cpu.sp;
+            snapshot.psr = cpu.getPSR();
+            snapshot.instr_reg = cpu.instr_reg;
+            snapshot.pc = cpu.pc;
+            snapshot.cycles = cpu.cycles;
+            snapshot.instructions = cpu.instructions;
+            snapshot.interrupts = cpu.interrupts.state();
+
+            bus.savePages(snapshot.pages);
+
+            for (Peripheral* peripheral: bus.peripherals) {
+                snapshot.devices.push_back(peripheral->saveState());
+            }
+
+            return snapshot;
+        }
+
+        void restore(const Snapshot& snapshot) {
+            cpu.accumulator = snapshot.accumulator;
+            cpu.x = snapshot.x;
+            cpu.y = snapshot.y;
+            cpu.sp = snapshot.sp;
+            cpu.setPSR(snapshot.psr);
+            cpu.instr_reg = snapshot.instr_reg;
+            cpu.pc = snapshot.pc;
+            cpu.cycles = snapshot.cycles;
+            cpu.instructions = snapshot.instructions;
+            cpu.interrupts.setState(snapshot.interrupts);
+
+            bus.loadPages(snapshot.pages);
+
+            for (size_t i = 0; i < bus.peripherals.size() && i < snapshot.devices.size(); i++) {
+                bus.peripherals[i]->loadState(snapshot.devices[i]);
+            }
+        }
+
+    private:
+        void attach(InputLog& log) {
+            bus.inputLog = &log;
+            cpu.inputLog = &log;
+
+            // Replayed interrupts are taken at their cycle by a scheduled event
+            log.scheduleInterrupt = [this, &log](InputLog::Kind kind, uint64_t when) {
+                uint64_t generation = log.generation();
+
+                cpu.scheduler.at(when, [this, &log, kind, generation](uint64_t) {
+                    // The log was rewound since
+                    if (log.generation() != generation) return;
+
+                    if (kind == InputLog::NMI) cpu.executeNMI();
+                    else cpu.executeIRQ();
+
+                    log.interruptTaken();
+                });
+            };
+        }
+};
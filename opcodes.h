@@ -0,0 +1,541 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+
+/*
+Opcode metadata shared by the interpreter, the debugger output and anything
+else that needs to know what an opcode is. There is one table per CPU
+variant, opcodes is the NMOS one.
+    - https://www.masswerk.at/6502/6502_instruction_set.html
+    - https://www.masswerk.at/6502/6502_instruction_set.html#illegals
+    - http://www.6502.org/tutorials/65c02opcodes.html
+*/
+
+// Which processor the CPU emulates, a template argument of CPU and Machine
+enum class Variant : uint8_t {
+    NMOS,               // documented NMOS 6502 instructions, anything else stops the CPU
+    NMOS_UNDOCUMENTED,  // plus the stable undocumented opcodes (LAX, SAX, DCP, ISC, SLO, ...)
+    CMOS,               // WDC 65C02: new instructions and modes, unused opcodes are NOPs
+    RICOH_2A03          // the NES CPU, NMOS with the undocumented opcodes and no decimal mode
+};
+
+constexpr const char* variantNames[] = {"nmos", "undocumented", "65c02", "2a03"};
+
+enum AddressingMode : uint8_t {
+    IMPLIED,
+    ACCUMULATOR,
+    IMMEDIATE,
+    ZERO_PAGE,
+    ZERO_PAGE_X,
+    ZERO_PAGE_Y,
+    ABSOLUTE,
+    ABSOLUTE_X,
+    ABSOLUTE_Y,
+    INDIRECT,
+    INDEXED_INDIRECT,
+    INDIRECT_INDEXED,
+    RELATIVE,
+    ZERO_PAGE_INDIRECT,         // 65C02 (zp)
+    ABSOLUTE_INDEXED_INDIRECT,  // 65C02 JMP (abs,X)
+    ZERO_PAGE_RELATIVE          // 65C02 BBR/BBS: zero page address, then branch offset
+};
+
+// Same notation the debug output always used
+constexpr const char* modeNames[] = {
+    "", "A", "#", "zpg", "zpg, X", "zpg, Y", "abs", "abs, X", "abs, Y", "ind", "X, ind", "ind, Y", "rel",
+    "zpg, ind", "abs, X, ind", "zpg, rel"
+};
+
+constexpr uint8_t modeLength(AddressingMode mode) {
+    switch (mode) {
+        case IMPLIED:
+        case ACCUMULATOR:
+            return 1;
+        case ABSOLUTE:
+        case ABSOLUTE_X:
+        case ABSOLUTE_Y:
+        case INDIRECT:
+        case ABSOLUTE_INDEXED_INDIRECT:
+        case ZERO_PAGE_RELATIVE:
+            return 3;
+        default:
+            return 2;
+    }
+}
+
+enum class Instruction : uint8_t {
+    ADC, AND, ASL, BCC, BCS, BEQ, BIT, BMI, BNE, BPL, BRK, BVC, BVS, CLC,
+    CLD, CLI, CLV, CMP, CPX, CPY, DEC, DEX, DEY, EOR, INC, INX, INY, JMP,
+    JSR, LDA, LDX, LDY, LSR, NOP, ORA, PHA, PHP, PLA, PLP, ROL, ROR, RTI,
+    RTS, SBC, SEC, SED, SEI, STA, STX, STY, TAX, TAY, TSX, TXA, TXS, TYA,
+    // 65C02
+    BBR, BBS, BRA, PHX, PHY, PLX, PLY, RMB, SMB, STP, STZ, TRB, TSB, WAI,
+    // Undocumented NMOS
+    ALR, ANC, ARR, DCP, ISC, LAS, LAX, RLA, RRA, SAX, SBX, SLO, SRE,
+    UNKNOWN
+};
+
+constexpr const char* mnemonics[] = {
+    "ADC", "AND", "ASL", "BCC", "BCS", "BEQ", "BIT", "BMI", "BNE", "BPL", "BRK", "BVC", "BVS", "CLC",
+    "CLD", "CLI", "CLV", "CMP", "CPX", "CPY", "DEC", "DEX", "DEY", "EOR", "INC", "INX", "INY", "JMP",
+    "JSR", "LDA", "LDX", "LDY", "LSR", "NOP", "ORA", "PHA", "PHP", "PLA", "PLP", "ROL", "ROR", "RTI",
+    "RTS", "SBC", "SEC", "SED", "SEI", "STA", "STX", "STY", "TAX", "TAY", "TSX", "TXA", "TXS", "TYA",
+    "BBR", "BBS", "BRA", "PHX", "PHY", "PLX", "PLY", "RMB", "SMB", "STP", "STZ", "TRB", "TSB", "WAI",
+    "ALR", "ANC", "ARR", "DCP", "ISC", "LAS", "LAX", "RLA", "RRA", "SAX", "SBX", "SLO", "SRE",
+    "???"
+};
+
+// Instructions that load pc themselves instead of stepping over their operand
+constexpr bool changesPC(Instruction instruction) {
+    switch (instruction) {
+        case Instruction::BCC:
+        case Instruction::BCS:
+        case Instruction::BEQ:
+        case Instruction::BMI:
+        case Instruction::BNE:
+        case Instruction::BPL:
+        case Instruction::BVC:
+        case Instruction::BVS:
+        case Instruction::BRA:
+        case Instruction::BBR:
+        case Instruction::BBS:
+        case Instruction::BRK:
+        case Instruction::JMP:
+        case Instruction::JSR:
+        case Instruction::RTI:
+        case Instruction::RTS:
+        case Instruction::STP:
+        case Instruction::WAI:
+        case Instruction::UNKNOWN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// 65C02 instructions that take a bit number from their opcode
+constexpr bool isBitInstruction(Instruction instruction) {
+    return instruction == Instruction::RMB || instruction == Instruction::SMB ||
+        instruction == Instruction::BBR || instruction == Instruction::BBS;
+}
+
+struct Opcode {
+    Instruction instruction = Instruction::UNKNOWN;
+    AddressingMode mode = IMPLIED;
+    uint8_t length = 1;
+    uint8_t cycles = 0;
+
+    constexpr const char* mnemonic() const {
+        return mnemonics[(int)instruction];
+    }
+};
+
+struct OpcodeDescriptor {
+    uint8_t code;
+    Instruction instruction;
+    AddressingMode mode;
+    uint8_t cycles;
+};
+
+// Documented NMOS 6502 instruction set with base cycle counts
+constexpr OpcodeDescriptor opcodeList[] = {
+    {0x69, Instruction::ADC, IMMEDIATE, 2},
+    {0x65, Instruction::ADC, ZERO_PAGE, 3},
+    {0x75, Instruction::ADC, ZERO_PAGE_X, 4},
+    {0x6d, Instruction::ADC, ABSOLUTE, 4},
+    {0x7d, Instruction::ADC, ABSOLUTE_X, 4},
+    {0x79, Instruction::ADC, ABSOLUTE_Y, 4},
+    {0x61, Instruction::ADC, INDEXED_INDIRECT, 6},
+    {0x71, Instruction::ADC, INDIRECT_INDEXED, 5},
+
+    {0x29, Instruction::AND, IMMEDIATE, 2},
+    {0x25, Instruction::AND, ZERO_PAGE, 3},
+    {0x35, Instruction::AND, ZERO_PAGE_X, 4},
+    {0x2d, Instruction::AND, ABSOLUTE, 4},
+    {0x3d, Instruction::AND, ABSOLUTE_X, 4},
+    {0x39, Instruction::AND, ABSOLUTE_Y, 4},
+    {0x21, Instruction::AND, INDEXED_INDIRECT, 6},
+    {0x31, Instruction::AND, INDIRECT_INDEXED, 5},
+
+    {0x0a, Instruction::ASL, ACCUMULATOR, 2},
+    {0x06, Instruction::ASL, ZERO_PAGE, 5},
+    {0x16, Instruction::ASL, ZERO_PAGE_X, 6},
+    {0x0e, Instruction::ASL, ABSOLUTE, 6},
+    {0x1e, Instruction::ASL, ABSOLUTE_X, 7},
+
+    {0x90, Instruction::BCC, RELATIVE, 2},
+    {0xb0, Instruction::BCS, RELATIVE, 2},
+    {0xf0, Instruction::BEQ, RELATIVE, 2},
+    {0x30, Instruction::BMI, RELATIVE, 2},
+    {0xd0, Instruction::BNE, RELATIVE, 2},
+    {0x10, Instruction::BPL, RELATIVE, 2},
+    {0x50, Instruction::BVC, RELATIVE, 2},
+    {0x70, Instruction::BVS, RELATIVE, 2},
+
+    {0x24, Instruction::BIT, ZERO_PAGE, 3},
+    {0x2c, Instruction::BIT, ABSOLUTE, 4},
+
+    {0x00, Instruction::BRK, IMPLIED, 7},
+
+    {0x18, Instruction::CLC, IMPLIED, 2},
+    {0xd8, Instruction::CLD, IMPLIED, 2},
+    {0x58, Instruction::CLI, IMPLIED, 2},
+    {0xb8, Instruction::CLV, IMPLIED, 2},
+
+    {0xc9, Instruction::CMP, IMMEDIATE, 2},
+    {0xc5, Instruction::CMP, ZERO_PAGE, 3},
+    {0xd5, Instruction::CMP, ZERO_PAGE_X, 4},
+    {0xcd, Instruction::CMP, ABSOLUTE, 4},
+    {0xdd, Instruction::CMP, ABSOLUTE_X, 4},
+    {0xd9, Instruction::CMP, ABSOLUTE_Y, 4},
+    {0xc1, Instruction::CMP, INDEXED_INDIRECT, 6},
+    {0xd1, Instruction::CMP, INDIRECT_INDEXED, 5},
+
+    {0xe0, Instruction::CPX, IMMEDIATE, 2},
+    {0xe4, Instruction::CPX, ZERO_PAGE, 3},
+    {0xec, Instruction::CPX, ABSOLUTE, 4},
+
+    {0xc0, Instruction::CPY, IMMEDIATE, 2},
+    {0xc4, Instruction::CPY, ZERO_PAGE, 3},
+    {0xcc, Instruction::CPY, ABSOLUTE, 4},
+
+    {0xc6, Instruction::DEC, ZERO_PAGE, 5},
+    {0xd6, Instruction::DEC, ZERO_PAGE_X, 6},
+    {0xce, Instruction::DEC, ABSOLUTE, 6},
+    {0xde, Instruction::DEC, ABSOLUTE_X, 7},
+
+    {0xca, Instruction::DEX, IMPLIED, 2},
+    {0x88, Instruction::DEY, IMPLIED, 2},
+
+    {0x49, Instruction::EOR, IMMEDIATE, 2},
+    {0x45, Instruction::EOR, ZERO_PAGE, 3},
+    {0x55, Instruction::EOR, ZERO_PAGE_X, 4},
+    {0x4d, Instruction::EOR, ABSOLUTE, 4},
+    {0x5d, Instruction::EOR, ABSOLUTE_X, 4},
+    {0x59, Instruction::EOR, ABSOLUTE_Y, 4},
+    {0x41, Instruction::EOR, INDEXED_INDIRECT, 6},
+    {0x51, Instruction::EOR, INDIRECT_INDEXED, 5},
+
+    {0xe6, Instruction::INC, ZERO_PAGE, 5},
+    {0xf6, Instruction::INC, ZERO_PAGE_X, 6},
+    {0xee, Instruction::INC, ABSOLUTE, 6},
+    {0xfe, Instruction::INC, ABSOLUTE_X, 7},
+
+    {0xe8, Instruction::INX, IMPLIED, 2},
+    {0xc8, Instruction::INY, IMPLIED, 2},
+
+    {0x4c, Instruction::JMP, ABSOLUTE, 3},
+    {0x6c, Instruction::JMP, INDIRECT, 5},
+
+    {0x20, Instruction::JSR, ABSOLUTE, 6},
+
+    {0xa9, Instruction::LDA, IMMEDIATE, 2},
+    {0xa5, Instruction::LDA, ZERO_PAGE, 3},
+    {0xb5, Instruction::LDA, ZERO_PAGE_X, 4},
+    {0xad, Instruction::LDA, ABSOLUTE, 4},
+    {0xbd, Instruction::LDA, ABSOLUTE_X, 4},
+    {0xb9, Instruction::LDA, ABSOLUTE_Y, 4},
+    {0xa1, Instruction::LDA, INDEXED_INDIRECT, 6},
+    {0xb1, Instruction::LDA, INDIRECT_INDEXED, 5},
+
+    {0xa2, Instruction::LDX, IMMEDIATE, 2},
+    {0xa6, Instruction::LDX, ZERO_PAGE, 3},
+    {0xb6, Instruction::LDX, ZERO_PAGE_Y, 4},
+    {0xae, Instruction::LDX, ABSOLUTE, 4},
+    {0xbe, Instruction::LDX, ABSOLUTE_Y, 4},
+
+    {0xa0, Instruction::LDY, IMMEDIATE, 2},
+    {0xa4, Instruction::LDY, ZERO_PAGE, 3},
+    {0xb4, Instruction::LDY, ZERO_PAGE_X, 4},
+    {0xac, Instruction::LDY, ABSOLUTE, 4},
+    {0xbc, Instruction::LDY, ABSOLUTE_X, 4},
+
+    {0x4a, Instruction::LSR, ACCUMULATOR, 2},
+    {0x46, Instruction::LSR, ZERO_PAGE, 5},
+    {0x56, Instruction::LSR, ZERO_PAGE_X, 6},
+    {0x4e, Instruction::LSR, ABSOLUTE, 6},
+    {0x5e, Instruction::LSR, ABSOLUTE_X, 7},
+
+    {0xea, Instruction::NOP, IMPLIED, 2},
+
+    {0x09, Instruction::ORA, IMMEDIATE, 2},
+    {0x05, Instruction::ORA, ZERO_PAGE, 3},
+    {0x15, Instruction::ORA, ZERO_PAGE_X, 4},
+    {0x0d, Instruction::ORA, ABSOLUTE, 4},
+    {0x1d, Instruction::ORA, ABSOLUTE_X, 4},
+    {0x19, Instruction::ORA, ABSOLUTE_Y, 4},
+    {0x01, Instruction::ORA, INDEXED_INDIRECT, 6},
+    {0x11, Instruction::ORA, INDIRECT_INDEXED, 5},
+
+    {0x48, Instruction::PHA, IMPLIED, 3},
+    {0x08, Instruction::PHP, IMPLIED, 3},
+    {0x68, Instruction::PLA, IMPLIED, 4},
+    {0x28, Instruction::PLP, IMPLIED, 4},
+
+    {0x2a, Instruction::ROL, ACCUMULATOR, 2},
+    {0x26, Instruction::ROL, ZERO_PAGE, 5},
+    {0x36, Instruction::ROL, ZERO_PAGE_X, 6},
+    {0x2e, Instruction::ROL, ABSOLUTE, 6},
+    {0x3e, Instruction::ROL, ABSOLUTE_X, 7},
+
+    {0x6a, Instruction::ROR, ACCUMULATOR, 2},
+    {0x66, Instruction::ROR, ZERO_PAGE, 5},
+    {0x76, Instruction::ROR, ZERO_PAGE_X, 6},
+    {0x6e, Instruction::ROR, ABSOLUTE, 6},
+    {0x7e, Instruction::ROR, ABSOLUTE_X, 7},
+
+    {0x40, Instruction::RTI, IMPLIED, 6},
+    {0x60, Instruction::RTS, IMPLIED, 6},
+
+    {0xe9, Instruction::SBC, IMMEDIATE, 2},
+    {0xe5, Instruction::SBC, ZERO_PAGE, 3},
+    {0xf5, Instruction::SBC, ZERO_PAGE_X, 4},
+    {0xed, Instruction::SBC, ABSOLUTE, 4},
+    {0xfd, Instruction::SBC, ABSOLUTE_X, 4},
+    {0xf9, Instruction::SBC, ABSOLUTE_Y, 4},
+    {0xe1, Instruction::SBC, INDEXED_INDIRECT, 6},
+    {0xf1, Instruction::SBC, INDIRECT_INDEXED, 5},
+
+    {0x38, Instruction::SEC, IMPLIED, 2},
+    {0xf8, Instruction::SED, IMPLIED, 2},
+    {0x78, Instruction::SEI, IMPLIED, 2},
+
+    {0x85, Instruction::STA, ZERO_PAGE, 3},
+    {0x95, Instruction::STA, ZERO_PAGE_X, 4},
+    {0x8d, Instruction::STA, ABSOLUTE, 4},
+    {0x9d, Instruction::STA, ABSOLUTE_X, 5},
+    {0x99, Instruction::STA, ABSOLUTE_Y, 5},
+    {0x81, Instruction::STA, INDEXED_INDIRECT, 6},
+    {0x91, Instruction::STA, INDIRECT_INDEXED, 6},
+
+    {0x86, Instruction::STX, ZERO_PAGE, 3},
+    {0x96, Instruction::STX, ZERO_PAGE_Y, 4},
+    {0x8e, Instruction::STX, ABSOLUTE, 4},
+
+    {0x84, Instruction::STY, ZERO_PAGE, 3},
+    {0x94, Instruction::STY, ZERO_PAGE_X, 4},
+    {0x8c, Instruction::STY, ABSOLUTE, 4},
+
+    {0xaa, Instruction::TAX, IMPLIED, 2},
+    {0xa8, Instruction::TAY, IMPLIED, 2},
+    {0xba, Instruction::TSX, IMPLIED, 2},
+    {0x8a, Instruction::TXA, IMPLIED, 2},
+    {0x9a, Instruction::TXS, IMPLIED, 2},
+    {0x98, Instruction::TYA, IMPLIED, 2}
+};
+
+// Stable undocumented NMOS opcodes. The unstable ones (ANE, LXA, SHA, SHX,
+// SHY, TAS) and the JAMs are left unknown.
+constexpr OpcodeDescriptor undocumentedList[] = {
+    {0x4b, Instruction::ALR, IMMEDIATE, 2},
+    {0x0b, Instruction::ANC, IMMEDIATE, 2},
+    {0x2b, Instruction::ANC, IMMEDIATE, 2},
+    {0x6b, Instruction::ARR, IMMEDIATE, 2},
+    {0xcb, Instruction::SBX, IMMEDIATE, 2},
+    {0xeb, Instruction::SBC, IMMEDIATE, 2},
+    {0xbb, Instruction::LAS, ABSOLUTE_Y, 4},
+
+    {0xa7, Instruction::LAX, ZERO_PAGE, 3},
+    {0xb7, Instruction::LAX, ZERO_PAGE_Y, 4},
+    {0xaf, Instruction::LAX, ABSOLUTE, 4},
+    {0xbf, Instruction::LAX, ABSOLUTE_Y, 4},
+    {0xa3, Instruction::LAX, INDEXED_INDIRECT, 6},
+    {0xb3, Instruction::LAX, INDIRECT_INDEXED, 5},
+
+    {0x87, Instruction::SAX, ZERO_PAGE, 3},
+    {0x97, Instruction::SAX, ZERO_PAGE_Y, 4},
+    {0x8f, Instruction::SAX, ABSOLUTE, 4},
+    {0x83, Instruction::SAX, INDEXED_INDIRECT, 6},
+
+    {0xc7, Instruction::DCP, ZERO_PAGE, 5},
+    {0xd7, Instruction::DCP, ZERO_PAGE_X, 6},
+    {0xcf, Instruction::DCP, ABSOLUTE, 6},
+    {0xdf, Instruction::DCP, ABSOLUTE_X, 7},
+    {0xdb, Instruction::DCP, ABSOLUTE_Y, 7},
+    {0xc3, Instruction::DCP, INDEXED_INDIRECT, 8},
+    {0xd3, Instruction::DCP, INDIRECT_INDEXED, 8},
+
+    {0xe7, Instruction::ISC, ZERO_PAGE, 5},
+    {0xf7, Instruction::ISC, ZERO_PAGE_X, 6},
+    {0xef, Instruction::ISC, ABSOLUTE, 6},
+    {0xff, Instruction::ISC, ABSOLUTE_X, 7},
+    {0xfb, Instruction::ISC, ABSOLUTE_Y, 7},
+    {0xe3, Instruction::ISC, INDEXED_INDIRECT, 8},
+    {0xf3, Instruction::ISC, INDIRECT_INDEXED, 8},
+
+    {0x07, Instruction::SLO, ZERO_PAGE, 5},
+    {0x17, Instruction::SLO, ZERO_PAGE_X, 6},
+    {0x0f, Instruction::SLO, ABSOLUTE, 6},
+    {0x1f, Instruction::SLO, ABSOLUTE_X, 7},
+    {0x1b, Instruction::SLO, ABSOLUTE_Y, 7},
+    {0x03, Instruction::SLO, INDEXED_INDIRECT, 8},
+    {0x13, Instruction::SLO, INDIRECT_INDEXED, 8},
+
+    {0x27, Instruction::RLA, ZERO_PAGE, 5},
+    {0x37, Instruction::RLA, ZERO_PAGE_X, 6},
+    {0x2f, Instruction::RLA, ABSOLUTE, 6},
+    {0x3f, Instruction::RLA, ABSOLUTE_X, 7},
+    {0x3b, Instruction::RLA, ABSOLUTE_Y, 7},
+    {0x23, Instruction::RLA, INDEXED_INDIRECT, 8},
+    {0x33, Instruction::RLA, INDIRECT_INDEXED, 8},
+
+    {0x47, Instruction::SRE, ZERO_PAGE, 5},
+    {0x57, Instruction::SRE, ZERO_PAGE_X, 6},
+    {0x4f, Instruction::SRE, ABSOLUTE, 6},
+    {0x5f, Instruction::SRE, ABSOLUTE_X, 7},
+    {0x5b, Instruction::SRE, ABSOLUTE_Y, 7},
+    {0x43, Instruction::SRE, INDEXED_INDIRECT, 8},
+    {0x53, Instruction::SRE, INDIRECT_INDEXED, 8},
+
+    {0x67, Instruction::RRA, ZERO_PAGE, 5},
+    {0x77, Instruction::RRA, ZERO_PAGE_X, 6},
+    {0x6f, Instruction::RRA, ABSOLUTE, 6},
+    {0x7f, Instruction::RRA, ABSOLUTE_X, 7},
+    {0x7b, Instruction::RRA, ABSOLUTE_Y, 7},
+    {0x63, Instruction::RRA, INDEXED_INDIRECT, 8},
+    {0x73, Instruction::RRA, INDIRECT_INDEXED, 8},
+
+    // NOPs that still fetch their operands, and read them
+    {0x1a, Instruction::NOP, IMPLIED, 2},
+    {0x3a, Instruction::NOP, IMPLIED, 2},
+    {0x5a, Instruction::NOP, IMPLIED, 2},
+    {0x7a, Instruction::NOP, IMPLIED, 2},
+    {0xda, Instruction::NOP, IMPLIED, 2},
+    {0xfa, Instruction::NOP, IMPLIED, 2},
+    {0x80, Instruction::NOP, IMMEDIATE, 2},
+    {0x82, Instruction::NOP, IMMEDIATE, 2},
+    {0x89, Instruction::NOP, IMMEDIATE, 2},
+    {0xc2, Instruction::NOP, IMMEDIATE, 2},
+    {0xe2, Instruction::NOP, IMMEDIATE, 2},
+    {0x04, Instruction::NOP, ZERO_PAGE, 3},
+    {0x44, Instruction::NOP, ZERO_PAGE, 3},
+    {0x64, Instruction::NOP, ZERO_PAGE, 3},
+    {0x14, Instruction::NOP, ZERO_PAGE_X, 4},
+    {0x34, Instruction::NOP, ZERO_PAGE_X, 4},
+    {0x54, Instruction::NOP, ZERO_PAGE_X, 4},
+    {0x74, Instruction::NOP, ZERO_PAGE_X, 4},
+    {0xd4, Instruction::NOP, ZERO_PAGE_X, 4},
+    {0xf4, Instruction::NOP, ZERO_PAGE_X, 4},
+    {0x0c, Instruction::NOP, ABSOLUTE, 4},
+    {0x1c, Instruction::NOP, ABSOLUTE_X, 4},
+    {0x3c, Instruction::NOP, ABSOLUTE_X, 4},
+    {0x5c, Instruction::NOP, ABSOLUTE_X, 4},
+    {0x7c, Instruction::NOP, ABSOLUTE_X, 4},
+    {0xdc, Instruction::NOP, ABSOLUTE_X, 4},
+    {0xfc, Instruction::NOP, ABSOLUTE_X, 4}
+};
+
+// What the 65C02 adds to the documented set or changes in it. Opcodes in
+// neither list are NOPs there, see makeOpcodeTable().
+constexpr OpcodeDescriptor cmosList[] = {
+    {0x72, Instruction::ADC, ZERO_PAGE_INDIRECT, 5},
+    {0x32, Instruction::AND, ZERO_PAGE_INDIRECT, 5},
+    {0xd2, Instruction::CMP, ZERO_PAGE_INDIRECT, 5},
+    {0x52, Instruction::EOR, ZERO_PAGE_INDIRECT, 5},
+    {0xb2, Instruction::LDA, ZERO_PAGE_INDIRECT, 5},
+    {0x12, Instruction::ORA, ZERO_PAGE_INDIRECT, 5},
+    {0xf2, Instruction::SBC, ZERO_PAGE_INDIRECT, 5},
+    {0x92, Instruction::STA, ZERO_PAGE_INDIRECT, 5},
+
+    {0x89, Instruction::BIT, IMMEDIATE, 2},
+    {0x34, Instruction::BIT, ZERO_PAGE_X, 4},
+    {0x3c, Instruction::BIT, ABSOLUTE_X, 4},
+
+    {0x1a, Instruction::INC, ACCUMULATOR, 2},
+    {0x3a, Instruction::DEC, ACCUMULATOR, 2},
+
+    // Shifts and rotates on abs,X take one more cycle only across a page
+    {0x1e, Instruction::ASL, ABSOLUTE_X, 6},
+    {0x5e, Instruction::LSR, ABSOLUTE_X, 6},
+    {0x3e, Instruction::ROL, ABSOLUTE_X, 6},
+    {0x7e, Instruction::ROR, ABSOLUTE_X, 6},
+
+    {0x6c, Instruction::JMP, INDIRECT, 6},
+    {0x7c, Instruction::JMP, ABSOLUTE_INDEXED_INDIRECT, 6},
+
+    {0x80, Instruction::BRA, RELATIVE, 2},
+
+    {0xda, Instruction::PHX, IMPLIED, 3},
+    {0x5a, Instruction::PHY, IMPLIED, 3},
+    {0xfa, Instruction::PLX, IMPLIED, 4},
+    {0x7a, Instruction::PLY, IMPLIED, 4},
+
+    {0x64, Instruction::STZ, ZERO_PAGE, 3},
+    {0x74, Instruction::STZ, ZERO_PAGE_X, 4},
+    {0x9c, Instruction::STZ, ABSOLUTE, 4},
+    {0x9e, Instruction::STZ, ABSOLUTE_X, 5},
+
+    {0x14, Instruction::TRB, ZERO_PAGE, 5},
+    {0x1c, Instruction::TRB, ABSOLUTE, 6},
+    {0x04, Instruction::TSB, ZERO_PAGE, 5},
+    {0x0c, Instruction::TSB, ABSOLUTE, 6},
+
+    {0xcb, Instruction::WAI, IMPLIED, 3},
+    {0xdb, Instruction::STP, IMPLIED, 3},
+
+    // Unused opcodes with operands, the rest are one-byte, one-cycle NOPs
+    {0x02, Instruction::NOP, IMMEDIATE, 2},
+    {0x22, Instruction::NOP, IMMEDIATE, 2},
+    {0x42, Instruction::NOP, IMMEDIATE, 2},
+    {0x62, Instruction::NOP, IMMEDIATE, 2},
+    {0x82, Instruction::NOP, IMMEDIATE, 2},
+    {0xc2, Instruction::NOP, IMMEDIATE, 2},
+    {0xe2, Instruction::NOP, IMMEDIATE, 2},
+    {0x44, Instruction::NOP, ZERO_PAGE, 3},
+    {0x54, Instruction::NOP, ZERO_PAGE_X, 4},
+    {0xd4, Instruction::NOP, ZERO_PAGE_X, 4},
+    {0xf4, Instruction::NOP, ZERO_PAGE_X, 4},
+    {0x5c, Instruction::NOP, ABSOLUTE, 8},
+    {0xdc, Instruction::NOP, ABSOLUTE, 4},
+    {0xfc, Instruction::NOP, ABSOLUTE, 4}
+};
+
+template <size_t size>
+constexpr void addOpcodes(std::array<Opcode, 256>& table, const OpcodeDescriptor (&list)[size]) {
+    for (const OpcodeDescriptor& descriptor: list) {
+        Opcode& opcode = table[descriptor.code];
+        opcode.instruction = descriptor.instruction;
+        opcode.mode = descriptor.mode;
+        opcode.length = modeLength(descriptor.mode);
+        opcode.cycles = descriptor.cycles;
+    }
+}
+
+constexpr std::array<Opcode, 256> makeOpcodeTable(Variant variant) {
+    std::array<Opcode, 256> table{};
+
+    if (variant == Variant::CMOS) {
+        for (int code = 0; code < 0x100; code++) table[code] = {Instruction::NOP, IMPLIED, 1, 1};
+
+        // The WDC bit instructions, the bit number is in bits 4-6 of the opcode:
+        // RMB0-7 and SMB0-7 at x7, BBR0-7 and BBS0-7 at xf
+        for (int code = 0x07; code < 0x100; code += 0x10) {
+            bool set = (code & 0x80) != 0;
+            table[code] = {set ? Instruction::SMB : Instruction::RMB, ZERO_PAGE, 2, 5};
+            table[code + 0x08] = {set ? Instruction::BBS : Instruction::BBR, ZERO_PAGE_RELATIVE, 3, 5};
+        }
+    }
+
+    addOpcodes(table, opcodeList);
+
+    if (variant == Variant::NMOS_UNDOCUMENTED || variant == Variant::RICOH_2A03) addOpcodes(table, undocumentedList);
+    if (variant == Variant::CMOS) addOpcodes(table, cmosList);
+
+    return table;
+}
+
+template <Variant variant>
+constexpr std::array<Opcode, 256> opcodeTable = makeOpcodeTable(variant);
+
+constexpr const std::array<Opcode, 256>& opcodes = opcodeTable<Variant::NMOS>;
+
+// For code that picks the variant at run time
+constexpr const std::array<Opcode, 256>& opcodeTableFor(Variant variant) {
+    switch (variant) {
+        case Variant::NMOS_UNDOCUMENTED: return opcodeTable<Variant::NMOS_UNDOCUMENTED>;
+        case Variant::CMOS: return opcodeTable<Variant::CMOS>;
+        case Variant::RICOH_2A03: return opcodeTable<Variant::RICOH_2A03>;
+        default: return opcodeTable<Variant::NMOS>;
+    }
+}
@@ -0,0 +1,82 @@
+#include <iostream>
+#include <cstdint>
+
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bus.h"
+#include "loader.h"
+#include "recompiler.h"
+
+// Recompiles firmware to a C++ header for a specialized build, see recompiler.h
+int main(int argc, char** argv) {
+    std::vector<std::string> specs;
+    std::string name = "recompiled";
+    std::string out;
+    int variant = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "--load" && i + 1 < argc) {
+            specs.push_back(argv[++i]);
+        } else if (arg == "--rom" && i + 1 < argc) {
+            specs.push_back(std::string(argv[++i]) + ",ro");
+        } else if (arg == "--namespace" && i + 1 < argc) {
+            name = argv[++i];
+        } else if (arg == "--variant" && i + 1 < argc) {
+            std::string wanted = argv[++i];
+            for (variant = 0; variant < (int)std::size(variantNames); variant++) {
+                if (wanted == variantNames[variant]) break;
+            }
+            if (variant == (int)std::size(variantNames)) {
+                out.clear();
+                break;
+            }
+        } else if (out.empty() && arg[0] != '-') {
+            out = arg;
+        } else {
+            out.clear();
+            break;
+        }
+    }
+
+    if (specs.empty() || out.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [--load FILE[@ADDR]]... [--rom FILE[@ADDR]]... [--namespace NAME]" <<
+            " [--variant nmos|undocumented|65c02|2a03] OUT.h" << std::endl;
+        return 1;
+    }
+
+    // Same images, same order as the emulator will load them
+    auto bus = std::make_unique<Bus>();
+    std::string source;
+    for (const std::string& spec: specs) {
+        std::string error;
+        auto image = Image::open(spec, error);
+        if (image == nullptr) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        Image::load(image, *bus);
+
+        if (!source.empty()) source += " ";
+        source += spec;
+    }
+
+    Recompiler recompiler((Variant)variant);
+    recompiler.discover(*bus);
+
+    std::string error;
+    if (!recompiler.write(out, source, name, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    size_t instructions = 0;
+    for (const auto& entry: recompiler.blocks) instructions += entry.second.instructions.size();
+    std::cout << recompiler.blocks.size() << " blocks, " << instructions << " instructions" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+#include <array>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "bus.h"
+#include "opcodes.h"
+
+/*
+Ahead-of-time recompiler for fixed firmware. Starting from the reset, IRQ,
+NMI and BRK vectors it follows branches, jumps and subroutine calls through
+the images on a bus and writes every basic block it reaches as a C++
+function. A block function runs its instructions through the CPU's own
+handlers with the operands known at compile time, checking between them
+for the same things the block interpreter does.
+
+The generated header defines recompiled::install(cpu) (or NAME::install
+with a namespace given), which hands the blocks to CPU::addStaticCode().
+Blocks are decoded for one CPU variant and only install into that CPU.
+The header includes "cpu.h", so build with -I pointing at this directory
+unless it is written next to the sources.
+Only blocks whose bytes are in memory at that point are used, and a write
+to one of their pages drops them. Anything not discovered (code reached
+through JMP (ind), pushed return addresses or written at run time) is
+interpreted as before.
+*/
+
+class Recompiler {
+    public:
+        struct Decoded {
+            uint16_t address;
+            uint8_t code;
+            uint16_t operand;
+        };
+
+        struct Block {
+            uint16_t address;
+            uint16_t length;
+            std::vector<Decoded> instructions;
+        };
+
+        std::map<uint16_t, Block> blocks;
+
+        explicit Recompiler(Variant variant=Variant::NMOS) : variant(variant), opcodes(opcodeTableFor(variant)) {}
+
+        // Walks the code reachable from the vectors, reading only RAM and ROM pages
+        void discover(const Bus& bus) {
+            std::vector<uint16_t> work;
+            std::set<uint16_t> leaders;
+
+            auto enter = [&](uint16_t address) {
+                if (leaders.insert(address).second) work.push_back(address);
+            };
+
+            enter(vector(bus, 0xfffd, 0xfffc));     // reset
+            enter(vector(bus, 0xffff, 0xfffe));     // IRQ
+            enter(vector(bus, 0xfffb, 0xfffa));     // NMI
+            brkTarget = vector(bus, 0xfffe, 0xffff);
+            enter(brkTarget);                       // BRK, which reads its vector bytes the other way round
+
+            std::map<uint16_t, Decoded> decoded;
+
+            while (!work.empty()) {
+                uint16_t address = work.back();
+                work.pop_back();
+
+                while (decoded.count(address) == 0) {
+                    Decoded instruction;
+                    if (!decode(bus, address, instruction)) {
+                        // Left to the interpreter, but where it goes next is still known
+                        const uint8_t* bytes = host(bus, address);
+                        if (bytes != nullptr && !changesPC(opcodes[*bytes].instruction)) enter(address + opcodes[*bytes].length);
+                        break;
+                    }
+
+                    decoded[address] = instruction;
+                    const Opcode& opcode = opcodes[instruction.code];
+
+                    if (changesPC(opcode.instruction)) {
+                        for (uint16_t target: successors(instruction)) enter(target);
+                        break;
+                    }
+
+                    address += opcode.length;
+
+                    // Blocks stop at page boundaries, as the code caches do
+                    if ((address & 0xff) == 0) {
+                        enter(address);
+                        break;
+                    }
+                }
+            }
+
+            blocks.clear();
+            for (uint16_t leader: leaders) {
+                if (decoded.count(leader) == 0) continue;
+
+                Block block = {leader, 0, {}};
+                uint16_t address = leader;
+
+                while (true) {
+                    auto found = decoded.find(address);
+                    if (found == decoded.end()) break;
+
+                    const Opcode& opcode = opcodes[found->second.code];
+                    block.instructions.push_back(found->second);
+                    block.length += opcode.length;
+                    address += opcode.length;
+
+                    if (changesPC(opcode.instruction) || (address & 0xff) == 0 || leaders.count(address) > 0) break;
+                }
+
+                blocks[leader] = block;
+            }
+        }
+
+        // Writes the blocks as a header, source names the images in its comment
+        bool write(const std::string& path, const std::string& source, const std::string& name, std::string& error) const {
+            std::FILE* out = std::fopen(path.c_str(), "w");
+            if (out == nullptr) {
+                error = "cannot open " + path + " for writing";
+                return false;
+            }
+
+            std::fprintf(out, "// Generated by recompile from %s, do not edit.\n", source.c_str());
+            std::fprintf(out, "// %zu blocks. Needs the emulator sources on the include path for cpu.h.\n\n", blocks.size());
+            std::fprintf(out, "#pragma once\n\n#include <cstdint>\n\n#include <iterator>\n\n#include \"cpu.h\"\n\n");
+            std::fprintf(out, "namespace %s {\n", name.c_str());
+
+            for (const auto& [address, block]: blocks) {
+                std::fprintf(out, "\ntemplate <typename CPU>\nvoid block%04x(CPU& cpu) {\n", address);
+
+                // A loop back to its own start goes round without leaving the function
+                bool loops = false;
+                for (uint16_t target: successors(block.instructions.back())) loops = loops || target == address;
+
+                const char* indent = loops ? "        " : "    ";
+                if (loops) std::fprintf(out, "    while (true) {\n");
+
+                for (size_t i = 0; i < block.instructions.size(); i++) {
+                    const Decoded& instruction = block.instructions[i];
+                    const Opcode& opcode = opcodes[instruction.code];
+
+                    if (i > 0) std::fprintf(out, "%sif (cpu.blockExit()) return;\n", indent);
+                    std::fprintf(out, "%scpu.template executeDecoded<0x%02x>(0x%04x);    // %04x %s %s\n",
+                        indent, instruction.code, instruction.operand, instruction.address,
+                        mnemonics[(int)opcode.instruction], modeNames[opcode.mode]);
+                }
+
+                if (loops) std::fprintf(out, "        if (cpu.blockExit() || cpu.pc != 0x%04x) return;\n    }\n", address);
+                std::fprintf(out, "}\n");
+            }
+
+            std::fprintf(out, "\ntemplate <typename CPU>\nsize_t install(CPU& cpu) {\n");
+            std::fprintf(out, "    static_assert(CPU::variant == Variant::%s, \"recompiled for another CPU variant\");\n\n",
+                variantEnumerators[(int)variant]);
+            std::fprintf(out, "    static const typename CPU::StaticBlock blocks[] = {\n");
+
+            for (const auto& [address, block]: blocks) {
+                std::fprintf(out, "        {0x%04x, %u, (const uint8_t*)\"", address, block.length);
+                for (const Decoded& instruction: block.instructions) {
+                    const Opcode& opcode = opcodes[instruction.code];
+                    std::fprintf(out, "\\x%02x", instruction.code);
+                    if (opcode.length == 2) std::fprintf(out, "\\x%02x", instruction.operand);
+                    if (opcode.length == 3) std::fprintf(out, "\\x%02x\\x%02x", instruction.operand >> 8, instruction.operand & 0xff);
+                }
+                std::fprintf(out, "\", &block%04x<CPU>},\n", address);
+            }
+
+            std::fprintf(out, "    };\n\n    return cpu.addStaticCode(blocks, std::size(blocks));\n}\n\n}\n");
+
+            bool ok = std::fclose(out) == 0;
+            if (!ok) error = "cannot write " + path;
+            return ok;
+        }
+
+    private:
+        Variant variant;
+        const std::array<Opcode, 256>& opcodes;
+
+        // Where BRK goes, as read by discover()
+        uint16_t brkTarget = 0;
+
+        static constexpr const char* variantEnumerators[] = {"NMOS", "NMOS_UNDOCUMENTED", "CMOS", "RICOH_2A03"};
+
+        static const uint8_t* host(const Bus& bus, uint16_t address) {
+            const uint8_t* page = bus.pages[address >> 8].read;
+            return page != nullptr ? page + (address & 0xff) : nullptr;
+        }
+
+        static uint16_t vector(const Bus& bus, uint16_t high, uint16_t low) {
+            const uint8_t* h = host(bus, high);
+            const uint8_t* l = host(bus, low);
+            if (h == nullptr || l == nullptr) return 0;
+            return (uint16_t)*h << 8 | *l;
+        }
+
+        // False for device pages, unknown opcodes and instructions across a page boundary
+        bool decode(const Bus& bus, uint16_t address, Decoded& instruction) {
+            const uint8_t* bytes = host(bus, address);
+            if (bytes == nullptr) return false;
+
+            const Opcode& opcode = opcodes[bytes[0]];
+            if (opcode.instruction == Instruction::UNKNOWN) return false;
+            if ((address & 0xff) + opcode.length > 0x100) return false;
+
+            instruction.address = address;
+            instruction.code = bytes[0];
+            instruction.operand = 0;
+            if (opcode.length == 2) instruction.operand = bytes[1];
+            if (opcode.length == 3) instruction.operand = (uint16_t)bytes[1] << 8 | bytes[2];
+
+            return true;
+        }
+
+        // Where execution can go next, as far as the code itself says
+        std::vector<uint16_t> successors(const Decoded& instruction) const {
+            using I = Instruction;
+            const Opcode& opcode = opcodes[instruction.code];
+
+            switch (opcode.instruction) {
+                case I::BCC: case I::BCS: case I::BEQ: case I::BMI:
+                case I::BNE: case I::BPL: case I::BVC: case I::BVS:
+                    // Relative to the branch's own address, like CPU::branch()
+                    return {(uint16_t)(instruction.address + (int8_t)instruction.operand), (uint16_t)(instruction.address + 2)};
+                case I::BRA:
+                    return {(uint16_t)(instruction.address + (int8_t)instruction.operand)};
+                case I::BBR: case I::BBS:
+                    // The offset is the second operand byte
+                    return {(uint16_t)(instruction.address + (int8_t)(instruction.operand & 0xff)), (uint16_t)(instruction.address + 3)};
+                case I::WAI:
+                    return {(uint16_t)(instruction.address + 1)};
+                case I::JMP:
+                    if (opcode.mode == ABSOLUTE) return {instruction.operand};
+                    return {};
+                case I::JSR:
+                    // RTS comes back right after the JSR
+                    return {instruction.operand, (uint16_t)(instruction.address + 3)};
+                case I::BRK:
+                    // Not the bytes after it: in zero-filled memory every one is
+                    // another BRK. Code an RTI returns to is reached some other way.
+                    return {brkTarget};
+                default:
+                    return {};
+            }
+        }
+};
@@ -0,0 +1,355 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/*
+Record/replay of everything that reaches the CPU from outside: values read
+from peripherals, interrupts taken and the cycles a 65C02 WAI woke at.
+Recording a run and replaying the log from the same starting state gives a
+bit-identical run, whatever the devices or the host threads driving the
+interrupt lines do the second time.
+
+Each event is a varint of (cycles since the previous event << 2 | kind),
+followed by the value for device reads, so a read costs two bytes most of
+the time. Only device reads (already off the RAM fast path), interrupt
+entries and WAI are touched, nothing is added to the instruction loop.
+
+File layout: an 8-byte magic, uint32 version, uint32 zero, uint64 start
+cycle, then the events.
+*/
+
+class InputLog {
+    public:
+        enum Mode {OFF, RECORD, REPLAY};
+
+        enum Kind : uint8_t {READ, IRQ, NMI, WAKE};
+
+        static constexpr uint32_t VERSION = 1;
+
+        // A point in the log to seek back to: byte offset and the cycle deltas count from
+        struct Position {
+            size_t offset;
+            uint64_t cycle;
+        };
+
+    private:
+        static constexpr char MAGIC[8] = {'6', '5', '0', '2', 'R', 'P', 'L', 'Y'};
+        static constexpr size_t HEADER_SIZE = 24;
+
+        // Recording flushes to the file in chunks this big
+        static constexpr size_t FLUSH_SIZE = 1 << 16;
+
+        Mode mode = OFF;
+
+        std::vector<uint8_t> data;
+        std::FILE* out = nullptr;
+
+        const uint64_t* clock = nullptr;
+        uint64_t startCycle = 0;
+        uint64_t lastCycle = 0;
+
+        // Replay cursor and the decoded event it points at
+        size_t position = 0;
+        size_t pendingStart = 0;
+        uint64_t pendingBase = 0;
+        bool havePending = false;
+        Kind pendingKind = READ;
+        uint64_t pendingCycle = 0;
+        uint8_t pendingValue = 0;
+
+        bool divergedFlag = false;
+
+        // Bytes dropped from the front of an in-memory log, offsets stay as they were
+        size_t discarded = 0;
+
+        // Bumped on every seek, interrupts scheduled before it are stale
+        uint64_t generationCount = 0;
+
+        // Set by seek(): once the replay catches up, go on recording
+        bool resumeRecording = false;
+
+    public:
+        // Set when replaying, called with IRQ or NMI at the cycle it was taken
+        std::function<void(Kind, uint64_t)> scheduleInterrupt;
+
+        InputLog() = default;
+
+        InputLog(const InputLog&) = delete;
+        InputLog& operator=(const InputLog&) = delete;
+
+        ~InputLog() {
+            if (out != nullptr) {
+                flush();
+                std::fclose(out);
+            }
+        }
+
+        Mode getMode() const {
+            return mode;
+        }
+
+        bool replaying() const {
+            return mode == REPLAY;
+        }
+
+        // A replayed run asked for something the recording does not have
+        bool diverged() const {
+            return divergedFlag;
+        }
+
+        // Record events timed by clock, into memory or streamed to path
+        bool record(const uint64_t& clock, const std::string& path, std::string& error) {
+            this->clock = &clock;
+            startCycle = lastCycle = clock;
+            data.clear();
+
+            if (!path.empty()) {
+                out = std::fopen(path.c_str(), "wb");
+                if (out == nullptr) {
+                    error = "cannot open " + path + " for writing";
+                    return false;
+                }
+            }
+
+            uint8_t header[HEADER_SIZE] = {};
+            std::memcpy(header, MAGIC, sizeof(MAGIC));
+            std::memcpy(header + 8, &VERSION, sizeof(VERSION));
+            std::memcpy(header + 16, &startCycle, sizeof(startCycle));
+            data.assign(header, header + HEADER_SIZE);
+
+            mode = RECORD;
+            flush();
+            return true;
+        }
+
+        bool load(const std::string& path, std::string& error) {
+            std::FILE* file = std::fopen(path.c_str(), "rb");
+            if (file == nullptr) {
+                error = "cannot open " + path;
+                return false;
+            }
+
+            data.clear();
+            uint8_t buffer[1 << 14];
+            size_t count;
+            while ((count = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+                data.insert(data.end(), buffer, buffer + count);
+            }
+            std::fclose(file);
+
+            uint32_t version;
+            if (data.size() < HEADER_SIZE || std::memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0) {
+                error = path + ": not an input log";
+                return false;
+            }
+            std::memcpy(&version, data.data() + 8, sizeof(version));
+            if (version != VERSION) {
+                error = path + ": unsupported input log version " + std::to_string(version);
+                return false;
+            }
+            std::memcpy(&startCycle, data.data() + 16, sizeof(startCycle));
+
+            return true;
+        }
+
+        // Every recorded event has been replayed
+        bool finished() const {
+            return mode == REPLAY && !havePending;
+        }
+
+        uint64_t start() const {
+            return startCycle;
+        }
+
+        // Replay a loaded log against clock, which must start where the recording did
+        void replay(const uint64_t& clock) {
+            this->clock = &clock;
+            lastCycle = startCycle;
+            position = HEADER_SIZE;
+            divergedFlag = clock != startCycle;
+            resumeRecording = false;
+            generationCount++;
+            mode = REPLAY;
+
+            next();
+            announceInterrupt();
+        }
+
+        // Where the log stands now, in either mode
+        Position tell() const {
+            if (mode == REPLAY) {
+                if (havePending) return {pendingStart + discarded, pendingBase};
+                return {position + discarded, lastCycle};
+            }
+            return {data.size() + discarded, lastCycle};
+        }
+
+        // Rewinds an in-memory recording to pos and replays from there,
+        // recording again from where the recording had got to
+        void seek(Position pos) {
+            position = pos.offset - discarded;
+            lastCycle = pos.cycle;
+            divergedFlag = false;
+            resumeRecording = true;
+            generationCount++;
+            mode = REPLAY;
+
+            next();
+            announceInterrupt();
+        }
+
+        // Frees the part of an in-memory log before pos, nothing before it can be sought to
+        void discard(Position pos) {
+            size_t end = pos.offset - discarded;
+            if (end <= HEADER_SIZE) return;
+
+            if (mode == REPLAY) {
+                position -= end - HEADER_SIZE;
+                pendingStart -= end - HEADER_SIZE;
+            }
+            data.erase(data.begin() + HEADER_SIZE, data.begin() + end);
+            discarded += end - HEADER_SIZE;
+        }
+
+        uint64_t generation() const {
+            return generationCount;
+        }
+
+        // Recorded in memory, the whole log including the header
+        const std::vector<uint8_t>& bytes() const {
+            return data;
+        }
+
+        void flush() {
+            if (mode != RECORD || out == nullptr) return;
+
+            std::fwrite(data.data(), 1, data.size(), out);
+            std::fflush(out);
+            data.clear();
+        }
+
+        // Called by the bus with what a peripheral returned
+        uint8_t deviceRead(uint8_t value) {
+            if (mode == RECORD) {
+                put(READ);
+                data.push_back(value);
+                if (out != nullptr && data.size() >= FLUSH_SIZE) flush();
+                return value;
+            }
+
+            if (mode == REPLAY) {
+                if (!havePending || pendingKind != READ || pendingCycle != *clock) {
+                    divergedFlag = true;
+                    return value;
+                }
+
+                value = pendingValue;
+                next();
+                announceInterrupt();
+            }
+
+            return value;
+        }
+
+        // Called by the CPU as it enters an interrupt while recording
+        void interrupt(Kind kind) {
+            if (mode != RECORD) return;
+
+            put(kind);
+            if (out != nullptr && data.size() >= FLUSH_SIZE) flush();
+        }
+
+        // Called by WAI with whether a line is pending, masked or not. Replaying,
+        // whether the recorded WAI woke at this cycle instead.
+        bool wake(bool pending) {
+            if (mode == RECORD) {
+                if (pending) {
+                    put(WAKE);
+                    if (out != nullptr && data.size() >= FLUSH_SIZE) flush();
+                }
+                return pending;
+            }
+
+            if (mode == REPLAY) {
+                if (!havePending || pendingKind != WAKE || pendingCycle != *clock) {
+                    if (havePending && pendingKind == WAKE && pendingCycle < *clock) divergedFlag = true;
+                    return false;
+                }
+
+                next();
+                announceInterrupt();
+                return true;
+            }
+
+            return pending;
+        }
+
+        // Called by the replayed interrupt once it has been taken
+        void interruptTaken() {
+            next();
+            announceInterrupt();
+        }
+
+    private:
+        void put(Kind kind) {
+            uint64_t value = (*clock - lastCycle) << 2 | kind;
+            lastCycle = *clock;
+
+            while (value >= 0x80) {
+                data.push_back((uint8_t)value | 0x80);
+                value >>= 7;
+            }
+            data.push_back((uint8_t)value);
+        }
+
+        void next() {
+            havePending = false;
+            if (position >= data.size()) {
+                if (resumeRecording) mode = RECORD;
+                return;
+            }
+
+            pendingStart = position;
+            pendingBase = lastCycle;
+
+            uint64_t value = 0;
+            unsigned shift = 0;
+            while (position < data.size()) {
+                uint8_t byte = data[position++];
+                value |= (uint64_t)(byte & 0x7f) << shift;
+                shift += 7;
+                if (!(byte & 0x80)) break;
+            }
+
+            pendingKind = (Kind)(value & 3);
+            pendingCycle = lastCycle + (value >> 2);
+            lastCycle = pendingCycle;
+
+            if (pendingKind == READ) {
+                if (position >= data.size()) {
+                    // Cut off mid-event, which a seek would have to overwrite anyway
+                    position = pendingStart;
+                    lastCycle = pendingBase;
+                    if (resumeRecording) {
+                        data.resize(pendingStart);
+                        mode = RECORD;
+                    }
+                    return;
+                }
+                pendingValue = data[position++];
+            }
+
+            havePending = true;
+        }
+
+        void announceInterrupt() {
+            bool interrupt = pendingKind == IRQ || pendingKind == NMI;
+            if (havePending && interrupt && scheduleInterrupt) scheduleInterrupt(pendingKind, pendingCycle);
+        }
+};
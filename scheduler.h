@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+/*
+Cycle-driven event scheduler. Devices schedule callbacks at future cycle
+timestamps instead of running a host thread each. The CPU runs uninterrupted
+up to the next due event, then calls every callback that is due, all on the
+emulation thread, so device timing is deterministic and needs no locking.
+
+Events fire at the first instruction boundary at or after their timestamp.
+Callbacks get the timestamp they were scheduled for, so periodic devices can
+reschedule at when + period without drifting.
+*/
+
+class Scheduler {
+    struct Event {
+        uint64_t when;
+        uint64_t id;
+        std::function<void(uint64_t)> callback;
+        const void* owner;
+
+        // Earliest first, ties in scheduling order
+        bool operator>(const Event& other) const {
+            return when != other.when ? when > other.when : id > other.id;
+        }
+    };
+
+    const uint64_t& clock;
+
+    // A binary heap, earliest on top, kept in a vector so cancel() can take its event out
+    std::vector<Event> events;
+    uint64_t nextId = 0;
+
+    public:
+        // While the CPU runs, its loop limit, lowered when an earlier event is scheduled
+        uint64_t* deadline = nullptr;
+
+        explicit Scheduler(const uint64_t& clock) : clock(clock) {}
+
+        uint64_t now() const {
+            return clock;
+        }
+
+        // Timestamp of the earliest event, UINT64_MAX when there is none
+        uint64_t next() const {
+            return events.empty() ? UINT64_MAX : events.front().when;
+        }
+
+        bool empty() const {
+            return events.empty();
+        }
+
+        // owner tags the event for cancelOwned(), devices pass themselves
+        uint64_t at(uint64_t when, std::function<void(uint64_t)> callback, const void* owner=nullptr) {
+            uint64_t id = nextId++;
+            events.push_back({when, id, std::move(callback), owner});
+            std::push_heap(events.begin(), events.end(), std::greater<Event>());
+
+            if (deadline != nullptr && when < *deadline) *deadline = when;
+
+            return id;
+        }
+
+        uint64_t after(uint64_t cycles, std::function<void(uint64_t)> callback, const void* owner=nullptr) {
+            return at(clock + cycles, std::move(callback), owner);
+        }
+
+        // Taken out of the heap, so next() and empty() no longer see it.
+        // Events that already ran or were cancelled are left alone.
+        void cancel(uint64_t id) {
+            auto event = std::find_if(events.begin(), events.end(), [id](const Event& event) {
+                return event.id == id;
+            });
+            if (event == events.end()) return;
+
+            events.erase(event);
+            std::make_heap(events.begin(), events.end(), std::greater<Event>());
+        }
+
+        // Drops every event of owner, e.g. a device being restored
+        void cancelOwned(const void* owner) {
+            auto end = std::remove_if(events.begin(), events.end(), [owner](const Event& event) {
+                return event.owner == owner;
+            });
+            if (end == events.end()) return;
+
+            events.erase(end, events.end());
+            std::make_heap(events.begin(), events.end(), std::greater<Event>());
+        }
+
+        // Calls everything due by now, including events scheduled by those callbacks
+        void runDue() {
+            while (!events.empty() && events.front().when <= clock) {
+                std::pop_heap(events.begin(), events.end(), std::greater<Event>());
+                Event event = std::move(events.back());
+                events.pop_back();
+
+                event.callback(event.when);
+            }
+        }
+
+        void clear() {
+            events.clear();
+        }
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+#include <vector>
+
+#include "bus.h"
+
+/*
+Machine state captured by Machine::snapshot() and put back by restore():
+CPU registers and counters, interrupt lines, RAM and peripheral state.
+RAM pages are immutable and shared between snapshots, a snapshot only
+copies the pages written since the previous one, and a restore only
+copies pages that differ. Writes must go through the bus to be seen,
+poking bus.memory directly bypasses the tracking.
+
+Not captured: scheduled events, breakpoints and the trace. A Device drops
+its own events in loadState and starts behaviour() over, events the host
+scheduled itself are left as they are.
+*/
+
+struct Snapshot {
+    uint8_t accumulator;
+    uint8_t x;
+    uint8_t y;
+    uint8_t sp;
+    uint8_t psr;
+    uint8_t instr_reg;
+    uint16_t pc;
+
+    uint64_t cycles;
+    uint64_t instructions;
+
+    uint32_t interrupts;
+
+    PageSet pages;
+
+    // saveState() of every peripheral, in the bus' order
+    std::vector<std::vector<uint8_t>> devices;
+};
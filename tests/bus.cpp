@@ -0,0 +1,101 @@
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <iterator>
+
+#include "machine.h"
+
+// Runs each read-modify-write instruction on a device register and checks the
+// bus counts the accesses the chip makes: one read and two writes on the
+// NMOS 6502, two reads and one write on the 65C02:
+//     - step   one instruction at a time
+//     - loop   64 times round a loop, with the x86-64 JIT where the host has it
+
+constexpr uint16_t REGISTER = 0xd000;
+constexpr uint64_t ROUNDS = 64;
+
+// ASL, LSR, ROL, ROR, INC and DEC absolute
+constexpr uint8_t OPCODES[] = {0x0e, 0x4e, 0x2e, 0x6e, 0xee, 0xce};
+
+// One register that holds what was written to it
+class Latch: public Peripheral {
+    public:
+        uint8_t value = 0x5a;
+
+        Latch() {
+            name = "latch";
+            start = REGISTER;
+        }
+
+        void write(uint8_t /* address */, uint8_t value) override {
+            this->value = value;
+        }
+
+        uint8_t read(uint8_t /* address */) override {
+            return value;
+        }
+};
+
+// LDX #ROUNDS, then the instruction on the register, DEX, BNE back to it and
+// JMP to itself once done
+void program(uint8_t* memory, uint8_t opcode) {
+    const uint8_t code[] = {
+        0xa2, ROUNDS,
+        opcode, REGISTER >> 8, REGISTER & 0xff,
+        0xca,
+        0xd0, 0xfc,
+        0x4c, 0x02, 0x08,
+    };
+    std::copy(std::begin(code), std::end(code), &memory[0x0200]);
+
+    memory[0xfffd] = 0x02;
+    memory[0xfffc] = 0x00;
+}
+
+template <Variant variant>
+int check(uint8_t opcode, bool loop) {
+    constexpr bool cmos = variant == Variant::CMOS;
+    char what[64];
+
+    Machine<NoTrace, variant> machine;
+    Latch latch;
+    machine.addPeripheral(&latch);
+    program(machine.bus.memory, opcode);
+    machine.cpu.reset();
+
+    uint64_t rounds = 1;
+    if (loop) {
+        if (!machine.cpu.enableJit()) return 0;
+        machine.cpu.runCycles(ROUNDS * 16);
+        rounds = ROUNDS;
+    } else {
+        machine.cpu.runInstructions(2);
+    }
+
+    std::snprintf(what, sizeof(what), "%s %02x %s", variantNames[(int)variant], opcode, loop ? "loop" : "step");
+
+    uint64_t reads = rounds * (cmos ? 2 : 1);
+    uint64_t writes = rounds * (cmos ? 1 : 2);
+    if (machine.bus.deviceReads != reads || machine.bus.deviceWrites != writes) {
+        std::printf("%s: %llu reads and %llu writes, not %llu and %llu\n", what,
+            (unsigned long long)machine.bus.deviceReads, (unsigned long long)machine.bus.deviceWrites,
+            (unsigned long long)reads, (unsigned long long)writes);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main() {
+    int failures = 0;
+
+    for (uint8_t opcode: OPCODES) {
+        for (bool loop: {false, true}) {
+            failures += check<Variant::NMOS>(opcode, loop);
+            failures += check<Variant::CMOS>(opcode, loop);
+        }
+    }
+
+    std::printf("%zu instructions, %d failures\n", sizeof(OPCODES) * 2, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,84 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "program.h"
+
+// Saves random programs part way through with CheckpointWriter, loads the
+// file into a machine running another program and checks the restored state
+// is identical: registers, flags, counters, interrupt lines, memory and
+// device registers. Without devices both machines then run on and must stay
+// identical, with them behaviour() starts over on restore so only the
+// restored state is compared.
+
+constexpr int PROGRAMS = 50;
+
+template <Variant variant>
+int check(uint32_t seed, bool inputs, const std::string& path) {
+    char what[80];
+    std::string error;
+    const char* with = inputs ? " with inputs" : "";
+
+    Run<variant> saved(seed, inputs);
+
+    // A page of zeros, which the file marks but does not store
+    std::memset(&saved.machine.bus.memory[0x2000], 0, 0x100);
+
+    // Several saves in a row, the writer may skip all but the newest
+    CheckpointWriter writer;
+    for (uint64_t cycles: SLICES) {
+        saved.result = saved.machine.cpu.runCycles(cycles);
+        writer.save(saved.machine.snapshot(), path);
+    }
+    writer.wait();
+
+    MachineState expected = MachineState::of(saved.machine);
+    uint32_t lines = saved.machine.cpu.interrupts.state();
+
+    Run<variant> restored(seed + 1, inputs);
+    Snapshot snapshot;
+    if (!loadCheckpoint(path, snapshot, error)) {
+        std::printf("%s\n", error.c_str());
+        return 1;
+    }
+    restored.machine.restore(snapshot);
+
+    std::snprintf(what, sizeof(what), "%s seed %u%s restored", variantNames[(int)variant], seed, with);
+    int failures = MachineState::of(restored.machine).same(expected, what) ? 0 : 1;
+
+    if (restored.machine.cpu.interrupts.state() != lines) {
+        std::printf("%s: interrupt lines %08x != %08x\n", what, restored.machine.cpu.interrupts.state(), lines);
+        failures++;
+    }
+
+    if (!inputs) {
+        saved.slices();
+        restored.slices();
+
+        std::snprintf(what, sizeof(what), "%s seed %u run on", variantNames[(int)variant], seed);
+        failures += MachineState::of(restored.machine).same(MachineState::of(saved.machine), what) ? 0 : 1;
+    }
+
+    return failures;
+}
+
+int main() {
+    std::string path = "/tmp/checkpoint-test-" + std::to_string(getpid()) + ".ckpt";
+    int failures = 0;
+
+    for (uint32_t seed = 0; seed < PROGRAMS; seed++) {
+        for (bool inputs: {false, true}) {
+            failures += check<Variant::NMOS>(seed, inputs, path);
+            failures += check<Variant::CMOS>(seed, inputs, path);
+        }
+    }
+
+    std::remove(path.c_str());
+
+    std::printf("%d programs, %d failures\n", PROGRAMS * 4, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,167 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "program.h"
+
+// Runs random programs through the CPU's execution paths and checks they
+// end in the same state: registers, flags, memory and cycle counts.
+//     - blocks   runCycles() through the predecoded and threaded code
+//     - step     runInstructions(), one instruction at a time, for as many
+//                instructions as the block run took
+//     - jit      runCycles() with the x86-64 JIT, where the host has it. Built
+//                with JIT_HOT=2, so every block that runs twice is compiled.
+// Each program runs twice, on its own and with inputs: a device window the
+// program reads and writes, and IRQ and NMI at random cycles.
+// Then a few idle loops the block and JIT runs skip ahead through, checked
+// the same way.
+
+constexpr int PROGRAMS = 300;
+
+// Steps as many instructions as the block run took. A block run may end
+// having taken an interrupt after its last instruction, which the step run
+// takes by going on to the same cycle. runCycles() also runs the events due
+// when it returns, runInstructions() leaves them for the next instruction.
+template <typename CPU>
+void finish(CPU& cpu, const MachineState& expected) {
+    cpu.runInstructions(expected.instructions);
+    if (cpu.cycles < expected.cycles) cpu.runCycles(expected.cycles - cpu.cycles);
+    cpu.scheduler.runDue();
+}
+
+template <Variant variant>
+int check(uint32_t seed, bool inputs) {
+    const char* with = inputs ? " with inputs" : "";
+    char what[80];
+
+    Run<variant> blocks(seed, inputs);
+    blocks.slices();
+    MachineState expected = MachineState::of(blocks.machine);
+
+    Run<variant> step(seed, inputs);
+    finish(step.machine.cpu, expected);
+
+    std::snprintf(what, sizeof(what), "%s seed %u%s step", variantNames[(int)variant], seed, with);
+    int failures = MachineState::of(step.machine).same(expected, what) ? 0 : 1;
+
+    Run<variant> native(seed, inputs);
+    if (native.machine.cpu.enableJit()) {
+        native.slices();
+
+        std::snprintf(what, sizeof(what), "%s seed %u%s jit", variantNames[(int)variant], seed, with);
+        failures += MachineState::of(native.machine).same(expected, what) ? 0 : 1;
+    }
+
+    return failures;
+}
+
+// Register 0 goes between zero and not every thousand cycles or so, on scheduled events
+class Toggle : public Device {
+    public:
+        Toggle() {
+            name = "toggle";
+            start = 0xd000;
+        }
+
+    protected:
+        Task behaviour() override {
+            for (uint8_t value = 1;; value++) {
+                co_await cycles(1000 + value * 37);
+                registers[0] = registers[0] == 0 ? value : 0;
+            }
+        }
+};
+
+// Reads count up, so a loop polling it must not be skipped
+class Counter : public Peripheral {
+    uint8_t count = 0;
+
+    public:
+        Counter() {
+            name = "counter";
+            start = 0xd100;
+        }
+
+        void write(uint8_t /* address */, uint8_t /* value */) override {}
+
+        uint8_t read(uint8_t /* address */) override {
+            return ++count % 64 == 0;
+        }
+
+        std::vector<uint8_t> saveState() override {
+            return {count};
+        }
+};
+
+// A machine running a loop at 0200, with both devices
+struct IdleRun {
+    Machine<> machine;
+    Toggle toggle;
+    Counter counter;
+
+    explicit IdleRun(const std::vector<uint8_t>& code) {
+        std::memcpy(&machine.bus.memory[PROGRAM_START], code.data(), code.size());
+        machine.bus.memory[0xfffd] = PROGRAM_START >> 8;
+        machine.bus.memory[0xfffc] = PROGRAM_START & 0xff;
+        machine.cpu.reset();
+
+        machine.addPeripheral(&toggle);
+        machine.addPeripheral(&counter);
+    }
+
+    void slices() {
+        for (uint64_t cycles: {7ull, 1000ull, 12345ull, 1000000ull}) machine.cpu.runCycles(cycles);
+    }
+};
+
+// Absolute operands are high byte first, branches relative to their own address
+int idle(const char* name, const std::vector<uint8_t>& code) {
+    char what[64];
+
+    IdleRun blocks(code);
+    blocks.slices();
+    MachineState expected = MachineState::of(blocks.machine);
+
+    IdleRun step(code);
+    finish(step.machine.cpu, expected);
+
+    std::snprintf(what, sizeof(what), "idle %s step", name);
+    int failures = MachineState::of(step.machine).same(expected, what) ? 0 : 1;
+
+    IdleRun native(code);
+    if (native.machine.cpu.enableJit()) {
+        native.slices();
+
+        std::snprintf(what, sizeof(what), "idle %s jit", name);
+        failures += MachineState::of(native.machine).same(expected, what) ? 0 : 1;
+    }
+
+    return failures;
+}
+
+int main() {
+    int failures = 0;
+
+    // JMP *
+    failures += idle("trap", {0x4c, 0x02, 0x00});
+
+    // LDA $d000, BEQ back, INX, LDA $d000, BNE back, JMP 0200
+    failures += idle("steady", {0xad, 0xd0, 0x00, 0xf0, 0xfd, 0xe8, 0xad, 0xd0, 0x00, 0xd0, 0xfd, 0x4c, 0x02, 0x00});
+
+    // LDA $d100, BEQ back, INY, JMP 0200
+    failures += idle("counter", {0xad, 0xd1, 0x00, 0xf0, 0xfd, 0xc8, 0x4c, 0x02, 0x00});
+
+    for (uint32_t seed = 0; seed < PROGRAMS; seed++) {
+        for (bool inputs: {false, true}) {
+            failures += check<Variant::NMOS>(seed, inputs);
+            failures += check<Variant::CMOS>(seed, inputs);
+        }
+    }
+
+    Machine<> probe;
+    if (!probe.cpu.enableJit()) std::printf("no JIT on this host, compared step and blocks only\n");
+
+    std::printf("%d programs, %d failures\n", PROGRAMS * 4, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,34 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+#include "program.h"
+
+// Writes the random program for a seed as a 64K raw image, for recompile
+int main(int argc, char** argv) {
+    int variant = 0;
+    if (argc == 4) {
+        for (; variant < (int)std::size(variantNames); variant++) {
+            if (std::string(argv[2]) == variantNames[variant]) break;
+        }
+    }
+
+    if (argc != 4 || variant == (int)std::size(variantNames)) {
+        std::cerr << "Usage: " << argv[0] << " SEED nmos|undocumented|65c02|2a03 OUT.bin" << std::endl;
+        return 1;
+    }
+
+    static uint8_t memory[0x10000];
+    generateProgram(memory, std::strtoul(argv[1], nullptr, 10), (Variant)variant);
+
+    std::FILE* out = std::fopen(argv[3], "wb");
+    if (out == nullptr || std::fwrite(memory, 1, sizeof(memory), out) != sizeof(memory) || std::fclose(out) != 0) {
+        std::cerr << "cannot write " << argv[3] << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
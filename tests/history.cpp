@@ -0,0 +1,196 @@
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+#include "history.h"
+#include "program.h"
+
+// Runs random programs forward through History, keeping the state after
+// many of the instructions, then goes back with stepBack() and
+// reverseContinue() and checks each lands on exactly the state it had then:
+//     - stepBack   to states either side of every snapshot, from the end
+//                  and from the middle, then forward again over the log
+//     - reverse    reverseContinue() to every earlier stop at a breakpoint
+//     - evicted    with two thirds of the memory the whole run took, back to
+//                  the earliest state left and no further
+
+constexpr int PROGRAMS = 20;
+constexpr uint64_t INSTRUCTIONS = 3000;
+constexpr uint64_t INTERVAL = 250;
+
+template <Variant variant>
+struct Recording {
+    // Where pc was after each instruction, and the whole state after some
+    std::vector<uint16_t> pcs;
+    std::map<uint64_t, MachineState> states;
+
+    // Either side of each snapshot, every 17th instruction and the stops at breakpoint
+    bool kept(uint64_t instructions, uint16_t breakpoint) const {
+        uint64_t offset = instructions % INTERVAL;
+        return offset <= 1 || offset == INTERVAL - 1 || instructions % 17 == 0 || pcs.back() == breakpoint;
+    }
+
+    // Runs the program forward one instruction at a time through history
+    void run(Machine<NoTrace, variant>& machine, History<NoTrace, variant>& history, uint16_t breakpoint) {
+        pcs.push_back(machine.cpu.pc);
+        states.emplace(0, MachineState::of(machine));
+
+        while (machine.cpu.instructions < INSTRUCTIONS) {
+            if (history.step(1).instructions == 0) break;
+
+            pcs.push_back(machine.cpu.pc);
+            if (kept(machine.cpu.instructions, breakpoint)) states.emplace(machine.cpu.instructions, MachineState::of(machine));
+        }
+
+        // Where the run ended, if the program stopped early
+        states.emplace(machine.cpu.instructions, MachineState::of(machine));
+    }
+
+    bool at(Machine<NoTrace, variant>& machine, uint64_t instructions, const char* what) const {
+        if (machine.cpu.instructions != instructions) {
+            std::printf("%s: at instruction %llu, not %llu\n", what,
+                (unsigned long long)machine.cpu.instructions, (unsigned long long)instructions);
+            return false;
+        }
+        return MachineState::of(machine).same(states.at(instructions), what);
+    }
+};
+
+// The pc most often reached, so reverseContinue() has stops to go back over
+inline uint16_t busiest(const std::vector<uint16_t>& pcs) {
+    std::map<uint16_t, size_t> counts;
+    for (uint16_t pc: pcs) counts[pc]++;
+
+    uint16_t pc = pcs.back();
+    for (auto [address, count]: counts) {
+        if (count > counts[pc]) pc = address;
+    }
+    return pc;
+}
+
+template <Variant variant>
+int check(uint32_t seed) {
+    char what[80];
+    int failures = 0;
+
+    // A plain run first, to pick the breakpoint
+    Run<variant> plain(seed);
+    std::vector<uint16_t> path = {plain.machine.cpu.pc};
+    for (uint64_t i = 0; i < INSTRUCTIONS; i++) {
+        if (plain.machine.cpu.runInstructions(1).instructions == 0) break;
+        path.push_back(plain.machine.cpu.pc);
+    }
+    uint16_t breakpoint = busiest(path);
+
+    Run<variant> run(seed);
+    auto& cpu = run.machine.cpu;
+    History<NoTrace, variant> history(run.machine, INTERVAL);
+    Recording<variant> recording;
+    recording.run(run.machine, history, breakpoint);
+    uint64_t end = cpu.instructions;
+
+    // Back from the end to every state kept, with the largest steps first
+    for (auto kept = recording.states.rbegin(); kept != recording.states.rend(); kept++) {
+        uint64_t target = kept->first;
+        if (target >= end) continue;
+
+        history.seek(end);
+        std::snprintf(what, sizeof(what), "%s seed %u step back to %llu", variantNames[(int)variant], seed, (unsigned long long)target);
+        if (!history.stepBack(end - target)) {
+            std::printf("%s: stepBack fell short\n", what);
+            failures++;
+        }
+        failures += recording.at(run.machine, target, what) ? 0 : 1;
+    }
+
+    // One instruction at a time across the snapshots in the middle
+    history.seek(INTERVAL * 3 + 1);
+    for (uint64_t target = INTERVAL * 3; target + 2 >= INTERVAL * 2 && target < end; target--) {
+        history.stepBack(1);
+        if (recording.states.count(target) == 0) continue;
+
+        std::snprintf(what, sizeof(what), "%s seed %u step back one to %llu", variantNames[(int)variant], seed, (unsigned long long)target);
+        failures += recording.at(run.machine, target, what) ? 0 : 1;
+    }
+
+    // Forward again from there replays the log up to where the run ended
+    history.step(end - cpu.instructions);
+    std::snprintf(what, sizeof(what), "%s seed %u forward again", variantNames[(int)variant], seed);
+    failures += recording.at(run.machine, end, what) ? 0 : 1;
+
+    // Every earlier stop at the breakpoint, latest first, then the start
+    cpu.addBreakpoint(breakpoint);
+    uint64_t stops = 0;
+    for (uint64_t k = end; k-- > 0;) {
+        if (recording.pcs[k] != breakpoint) continue;
+
+        RunResult result = history.reverseContinue();
+        std::snprintf(what, sizeof(what), "%s seed %u reverse continue to %llu", variantNames[(int)variant], seed, (unsigned long long)k);
+        if (result.reason != StopReason::BREAKPOINT) {
+            std::printf("%s: stopped for %s\n", what, stopReasonNames[(int)result.reason]);
+            failures++;
+            break;
+        }
+        failures += recording.at(run.machine, k, what) ? 0 : 1;
+        stops++;
+    }
+
+    if (stops == 0) {
+        std::printf("%s seed %u: breakpoint %04x never reached\n", variantNames[(int)variant], seed, breakpoint);
+        failures++;
+    }
+
+    RunResult result = history.reverseContinue();
+    std::snprintf(what, sizeof(what), "%s seed %u reverse continue to the start", variantNames[(int)variant], seed);
+    if (result.reason != StopReason::BUDGET) {
+        std::printf("%s: stopped for %s\n", what, stopReasonNames[(int)result.reason]);
+        failures++;
+    }
+    failures += recording.at(run.machine, 0, what) ? 0 : 1;
+    cpu.removeBreakpoint(breakpoint);
+
+    // Again with a budget that drops the oldest snapshots
+    size_t budget = history.memoryUsed() * 2 / 3;
+    Run<variant> evicting(seed);
+    History<NoTrace, variant> small(evicting.machine, INTERVAL, budget);
+    Recording<variant> shortened;
+    shortened.run(evicting.machine, small, breakpoint);
+
+    uint64_t earliest = small.earliest();
+    std::snprintf(what, sizeof(what), "%s seed %u evicted", variantNames[(int)variant], seed);
+    if (earliest == 0 && end > INTERVAL) {
+        std::printf("%s: nothing evicted, %zu bytes used\n", what, small.memoryUsed());
+        failures++;
+    }
+
+    uint64_t middle = earliest + (end - earliest) / 2;
+    middle -= middle % 17;
+    if (middle > earliest) {
+        small.stepBack(evicting.machine.cpu.instructions - middle);
+        std::snprintf(what, sizeof(what), "%s seed %u evicted step back to %llu", variantNames[(int)variant], seed, (unsigned long long)middle);
+        failures += shortened.at(evicting.machine, middle, what) ? 0 : 1;
+    }
+
+    // Past the start of what is left it stops at the earliest state
+    if (small.stepBack(end)) {
+        std::printf("%s: stepBack went past the earliest state\n", what);
+        failures++;
+    }
+    std::snprintf(what, sizeof(what), "%s seed %u evicted step back to the earliest", variantNames[(int)variant], seed);
+    failures += shortened.at(evicting.machine, earliest, what) ? 0 : 1;
+
+    return failures;
+}
+
+int main() {
+    int failures = 0;
+
+    for (uint32_t seed = 0; seed < PROGRAMS; seed++) {
+        failures += check<Variant::NMOS>(seed);
+        failures += check<Variant::CMOS>(seed);
+    }
+
+    std::printf("%d programs, %d failures\n", PROGRAMS * 2, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,168 @@
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "loader.h"
+
+// Parses hand-written Intel HEX files and checks the segments they give and
+// what loading them puts in memory, or that they are refused:
+//     - segment (02) and linear (04) base records
+//     - a record with a bad checksum
+//     - data past the end of the 64 KB address space
+//     - adjacent records merged into one segment, others kept apart
+
+struct Expected {
+    uint16_t address;
+    std::vector<uint8_t> data;
+};
+
+// One record, with its checksum off by wrong
+std::string record(uint8_t type, uint16_t address, const std::vector<uint8_t>& data, uint8_t wrong=0) {
+    std::vector<uint8_t> bytes = {(uint8_t)data.size(), (uint8_t)(address >> 8), (uint8_t)address, type};
+    bytes.insert(bytes.end(), data.begin(), data.end());
+
+    uint8_t sum = 0;
+    for (uint8_t byte: bytes) sum += byte;
+    bytes.push_back((uint8_t)(-sum + wrong));
+
+    std::string text = ":";
+    char hex[3];
+    for (uint8_t byte: bytes) {
+        std::snprintf(hex, sizeof(hex), "%02X", byte);
+        text += hex;
+    }
+    return text + "\r\n";
+}
+
+const std::string END = record(0x01, 0, {});
+
+std::shared_ptr<Image> parse(const std::string& text, std::string& error) {
+    std::string path = "/tmp/loader-test-" + std::to_string(getpid()) + ".hex";
+
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    std::fwrite(text.data(), 1, text.size(), file);
+    std::fclose(file);
+
+    auto image = Image::open(path, error);
+    std::remove(path.c_str());
+    return image;
+}
+
+// Parses text and checks its segments, then loads it and checks the bytes land
+int accepts(const char* what, const std::string& text, const std::vector<Expected>& expected) {
+    std::string error;
+    auto image = parse(text, error);
+    if (image == nullptr) {
+        std::printf("%s: %s\n", what, error.c_str());
+        return 1;
+    }
+
+    if (image->segments.size() != expected.size()) {
+        std::printf("%s: %zu segments, not %zu\n", what, image->segments.size(), expected.size());
+        return 1;
+    }
+
+    auto bus = std::make_unique<Bus>();
+    Image::load(image, *bus);
+
+    for (size_t i = 0; i < expected.size(); i++) {
+        const Segment& segment = image->segments[i];
+        const Expected& want = expected[i];
+
+        if (segment.address != want.address || segment.size != want.data.size() ||
+            !std::equal(want.data.begin(), want.data.end(), segment.data)) {
+            std::printf("%s: segment %zu is %04x+%zu, not %04x+%zu\n", what, i, segment.address, segment.size, want.address, want.data.size());
+            return 1;
+        }
+
+        for (size_t j = 0; j < want.data.size(); j++) {
+            if (bus->memory[want.address + j] != want.data[j]) {
+                std::printf("%s: memory[%04zx] %02x != %02x\n", what, want.address + j, bus->memory[want.address + j], want.data[j]);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int refuses(const char* what, const std::string& text, const std::string& reason) {
+    std::string error;
+    if (parse(text, error) != nullptr) {
+        std::printf("%s: accepted\n", what);
+        return 1;
+    }
+
+    if (error.find(reason) == std::string::npos) {
+        std::printf("%s: refused with \"%s\", not for %s\n", what, error.c_str(), reason.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+int main() {
+    int failures = 0;
+
+    // Segment base 0x0100 puts offset 0x0010 at 0x1010
+    failures += accepts("segment base",
+        record(0x02, 0, {0x01, 0x00}) + record(0x00, 0x0010, {0xa9, 0x42}) + END,
+        {{0x1010, {0xa9, 0x42}}});
+
+    // Linear base 0 after a segment base goes back to plain addresses
+    failures += accepts("linear base",
+        record(0x02, 0, {0x01, 0x00}) + record(0x00, 0x0000, {0x01}) +
+        record(0x04, 0, {0x00, 0x00}) + record(0x00, 0x0000, {0x02}) + END,
+        {{0x1000, {0x01}}, {0x0000, {0x02}}});
+
+    // Linear base 1 is past 64 KB whatever the offset
+    failures += refuses("linear base past 64 KB",
+        record(0x04, 0, {0x00, 0x01}) + record(0x00, 0x0000, {0xea}) + END,
+        "outside the 64 KB address space");
+
+    // Segment base 0xf000 with offset 0x1000 lands on 0x10000
+    failures += refuses("segment base past 64 KB",
+        record(0x02, 0, {0xf0, 0x00}) + record(0x00, 0x1000, {0xea}) + END,
+        "outside the 64 KB address space");
+
+    failures += refuses("bad checksum",
+        record(0x00, 0x0200, {0xa9, 0x00, 0x60}, 1) + END,
+        "bad record on line 1");
+
+    failures += refuses("base record of the wrong length",
+        record(0x04, 0, {0x00}) + END,
+        "bad record length on line 1");
+
+    // Up to 0xffff is fine, one byte further is not
+    failures += accepts("record up to the top",
+        record(0x00, 0xfffc, {0x00, 0x02, 0x00, 0x03}) + END,
+        {{0xfffc, {0x00, 0x02, 0x00, 0x03}}});
+
+    failures += refuses("record past 0xffff",
+        record(0x00, 0xfffd, {0x00, 0x02, 0x00, 0x03}) + END,
+        "outside the 64 KB address space on line 1");
+
+    // Adjacent records become one segment, a gap starts another
+    failures += accepts("adjacent records merged",
+        record(0x00, 0x0200, {0xa9, 0x01}) + record(0x00, 0x0202, {0x8d, 0x00}) +
+        record(0x00, 0x0204, {0x10}) + record(0x00, 0x0300, {0x60}) + END,
+        {{0x0200, {0xa9, 0x01, 0x8d, 0x00, 0x10}}, {0x0300, {0x60}}});
+
+    // Adjacent in memory but not in order are kept apart
+    failures += accepts("records out of order kept apart",
+        record(0x00, 0x0202, {0x02}) + record(0x00, 0x0200, {0x00, 0x01}) + END,
+        {{0x0202, {0x02}}, {0x0200, {0x00, 0x01}}});
+
+    // Nothing after the end of file record is read
+    failures += accepts("end of file",
+        record(0x00, 0x0400, {0x11}) + END + "garbage\n",
+        {{0x0400, {0x11}}});
+
+    std::printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
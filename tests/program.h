@@ -0,0 +1,260 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "device.h"
+#include "machine.h"
+
+/*
+Random programs for the tests that run the same code through different
+execution paths. A seed fills memory with noise and writes a program of the
+variant's instructions from PROGRAM_START on, as a chain of short loops:
+random instructions, then LSR of a zero page counter and BNE back to the
+start. Branches inside a loop go forwards, JMP and JSR land on any
+instruction of the program. Operands mostly hit a data area and the zero page below the
+counters, some the program itself, so runs go through self-modifying code
+too. The reset, IRQ/BRK and NMI vectors all point into the program.
+
+Runs with inputs also have a device over the top of the data area, whose
+registers change on their own, and IRQ and NMI at random cycles.
+*/
+
+constexpr uint16_t PROGRAM_START = 0x0200;
+constexpr uint16_t PROGRAM_END = 0x0f00;
+constexpr uint16_t DATA_START = 0x1000;
+
+// Loop counters live at COUNTERS and up in the zero page
+constexpr uint8_t COUNTERS = 0xe0;
+
+// Not page aligned, so the pages either side are part RAM
+constexpr uint16_t DEVICE_START = 0x1380;
+
+inline void generateProgram(uint8_t* memory, uint32_t seed, Variant variant=Variant::NMOS) {
+    const std::array<Opcode, 256>& table = opcodeTableFor(variant);
+    std::mt19937 random(seed);
+
+    // Noise that would stop the CPU is BRK instead, which goes back into the program
+    for (int i = 0; i < 0x10000; i++) {
+        memory[i] = random() & 0x3f;
+        if (table[memory[i]].instruction == Instruction::UNKNOWN) memory[i] = 0x00;
+    }
+
+    auto anywhere = [&]() {
+        return (uint16_t)(PROGRAM_START + random() % (PROGRAM_END - PROGRAM_START));
+    };
+
+    // Jumps and forward branches get their targets once all instructions are known
+    std::vector<uint16_t> starts;
+    std::vector<uint16_t> jumps;
+    std::vector<uint16_t> branches;
+
+    uint16_t address = PROGRAM_START;
+    while (address < PROGRAM_END - 0x40) {
+        uint16_t loop = address;
+        unsigned length = 1 + random() % 12;
+
+        for (unsigned i = 0; i < length;) {
+            uint8_t code = random();
+            const Opcode& opcode = table[code];
+
+            // STP and WAI would end most runs early
+            if (opcode.instruction == Instruction::UNKNOWN || opcode.instruction == Instruction::STP) continue;
+            if (opcode.instruction == Instruction::WAI) continue;
+
+            // Returns and jumps through pointers mostly leave the program for
+            // the noise, so they are rarer than the rest
+            bool leaves = opcode.instruction == Instruction::RTS || opcode.instruction == Instruction::RTI ||
+                opcode.instruction == Instruction::BRK || opcode.mode == INDIRECT || opcode.mode == ABSOLUTE_INDEXED_INDIRECT;
+            if (leaves && random() % 8 != 0) continue;
+
+            bool jump = (opcode.instruction == Instruction::JMP && opcode.mode == ABSOLUTE) || opcode.instruction == Instruction::JSR;
+            if (jump) jumps.push_back(address);
+            if (opcode.mode == RELATIVE || opcode.mode == ZERO_PAGE_RELATIVE) branches.push_back(address);
+            starts.push_back(address);
+
+            uint16_t operand;
+            unsigned kind = random() % 10;
+            if (kind < 5) operand = DATA_START + random() % 0x400;
+            else if (kind < 6) operand = anywhere();
+            else operand = random() % COUNTERS;
+
+            memory[address] = code;
+            if (opcode.mode == ZERO_PAGE_RELATIVE) {
+                memory[address + 1] = random() % COUNTERS;
+            } else if (opcode.length == 2) {
+                memory[address + 1] = opcode.mode == IMMEDIATE ? (uint8_t)random() : (uint8_t)operand;
+            } else if (opcode.length == 3) {
+                // Absolute operands are stored high byte first
+                memory[address + 1] = operand >> 8;
+                memory[address + 2] = operand;
+            }
+
+            address += opcode.length;
+            i++;
+        }
+
+        // LSR counter, BNE loop: a few rounds, then once each time through
+        starts.push_back(address);
+        memory[address] = 0x46;
+        memory[address + 1] = COUNTERS + random() % (0x100 - COUNTERS);
+        memory[address + 2] = 0xd0;
+        memory[address + 3] = (uint8_t)(loop - (address + 2));
+        address += 4;
+    }
+
+    for (uint16_t jump: jumps) {
+        uint16_t target = starts[random() % starts.size()];
+        memory[jump + 1] = target >> 8;
+        memory[jump + 2] = target;
+    }
+
+    // One of the next few instructions, relative to the branch's own address
+    for (uint16_t branch: branches) {
+        size_t next = std::upper_bound(starts.begin(), starts.end(), branch) - starts.begin();
+        size_t last = std::min(next + 8, starts.size());
+        uint16_t target = next < last ? starts[next + random() % (last - next)] : branch;
+
+        uint8_t offset = (uint8_t)(target - branch);
+        if (table[memory[branch]].mode == ZERO_PAGE_RELATIVE) memory[branch + 2] = offset;
+        else memory[branch + 1] = offset;
+    }
+
+    memory[0xfffd] = PROGRAM_START >> 8;
+    memory[0xfffc] = PROGRAM_START & 0xff;
+    // Same bytes both ways round, so BRK and IRQ both go to 0303
+    memory[0xffff] = 0x03;
+    memory[0xfffe] = 0x03;
+    memory[0xfffb] = 0x04;
+    memory[0xfffa] = 0x00;
+}
+
+// What two runs of the same program must agree on
+struct MachineState {
+    uint16_t pc;
+    uint8_t accumulator;
+    uint8_t x, y;
+    uint8_t sp;
+    uint8_t psr;
+    uint64_t cycles;
+    uint64_t instructions;
+    std::vector<uint8_t> memory;
+    std::vector<std::vector<uint8_t>> devices;
+
+    template <typename Machine>
+    static MachineState of(Machine& machine) {
+        auto& cpu = machine.cpu;
+        MachineState state = {cpu.pc, cpu.accumulator, cpu.x, cpu.y, cpu.sp, cpu.getPSR(), cpu.cycles, cpu.instructions,
+            std::vector<uint8_t>(machine.bus.memory, machine.bus.memory + 0x10000), {}};
+
+        for (Peripheral* peripheral: machine.bus.peripherals) state.devices.push_back(peripheral->saveState());
+        return state;
+    }
+
+    // Prints the first difference, false if there is one
+    bool same(const MachineState& other, const char* what) const {
+        char difference[96] = "";
+
+        if (pc != other.pc) std::snprintf(difference, sizeof(difference), "pc %04x != %04x", pc, other.pc);
+        else if (accumulator != other.accumulator) std::snprintf(difference, sizeof(difference), "A %02x != %02x", accumulator, other.accumulator);
+        else if (x != other.x) std::snprintf(difference, sizeof(difference), "X %02x != %02x", x, other.x);
+        else if (y != other.y) std::snprintf(difference, sizeof(difference), "Y %02x != %02x", y, other.y);
+        else if (sp != other.sp) std::snprintf(difference, sizeof(difference), "SP %02x != %02x", sp, other.sp);
+        else if (psr != other.psr) std::snprintf(difference, sizeof(difference), "P %02x != %02x", psr, other.psr);
+        else if (cycles != other.cycles) {
+            std::snprintf(difference, sizeof(difference), "cycles %llu != %llu", (unsigned long long)cycles, (unsigned long long)other.cycles);
+        } else if (instructions != other.instructions) {
+            std::snprintf(difference, sizeof(difference), "instructions %llu != %llu",
+                (unsigned long long)instructions, (unsigned long long)other.instructions);
+        } else {
+            for (int i = 0; i < 0x10000; i++) {
+                if (memory[i] == other.memory[i]) continue;
+                std::snprintf(difference, sizeof(difference), "memory[%04x] %02x != %02x", i, memory[i], other.memory[i]);
+                break;
+            }
+
+            for (size_t i = 0; difference[0] == 0 && i < devices.size() && i < other.devices.size(); i++) {
+                if (devices[i] != other.devices[i]) std::snprintf(difference, sizeof(difference), "device %zu state differs", i);
+            }
+        }
+
+        if (difference[0] == 0) return true;
+
+        std::printf("%s: %s\n", what, difference);
+        return false;
+    }
+};
+
+// Split unevenly so runs also end in the middle of blocks
+constexpr uint64_t SLICES[] = {7, 1000, 12345, 30000};
+
+// Registers that change on their own every few hundred cycles
+class NoiseDevice : public Device {
+    std::mt19937 random;
+
+    public:
+        explicit NoiseDevice(uint32_t seed) : random(seed) {
+            name = "noise";
+            start = DEVICE_START;
+        }
+
+    protected:
+        Task behaviour() override {
+            while (true) {
+                co_await cycles(1 + random() % 500);
+                registers[random() & 0xff] = random();
+            }
+        }
+};
+
+// A machine reset into the program for a seed
+template <Variant variant>
+struct Run {
+    Machine<NoTrace, variant> machine;
+    NoiseDevice device;
+    RunResult result = {StopReason::BUDGET, 0, 0};
+
+    // With inputs, the device is on the bus and interrupts come at random cycles
+    explicit Run(uint32_t seed, bool inputs=false) : device(seed) {
+        generateProgram(machine.bus.memory, seed, variant);
+        machine.cpu.reset();
+
+        if (inputs) {
+            machine.addPeripheral(&device);
+            scheduleInterrupts(seed);
+        }
+    }
+
+    void slices() {
+        for (uint64_t cycles: SLICES) {
+            result = machine.cpu.runCycles(cycles);
+            if (result.reason != StopReason::BUDGET) break;
+        }
+    }
+
+    // IRQ asserted and released, and NMI pulses, a couple of thousand cycles apart
+    void scheduleInterrupts(uint32_t seed) {
+        std::mt19937 random(seed);
+        InterruptLines& lines = machine.cpu.interrupts;
+
+        uint64_t when = 0;
+        for (int i = 0; i < 32; i++) {
+            when += 1 + random() % 3000;
+
+            switch (random() % 3) {
+                case 0:
+                    machine.cpu.scheduler.at(when, [&lines](uint64_t) { lines.assertIRQ(); });
+                    break;
+                case 1:
+                    machine.cpu.scheduler.at(when, [&lines](uint64_t) { lines.releaseIRQ(); });
+                    break;
+                default:
+                    machine.cpu.scheduler.at(when, [&lines](uint64_t) { lines.triggerNMI(); });
+                    break;
+            }
+        }
+    }
+};
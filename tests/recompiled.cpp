@@ -0,0 +1,44 @@
+#include <cstdint>
+#include <cstdio>
+
+#include "program.h"
+
+// The recompiled headers and PROGRAMS, written by the build: each entry runs
+// PROGRAM(variant, name, seed) for a random program that recompile turned
+// into namespace name.
+#include "programs.h"
+
+// Runs random programs recompiled ahead of time and checks they end in the
+// same state as the block interpreter: registers, flags, memory and cycles.
+template <Variant variant, typename Install>
+int check(const char* name, uint32_t seed, Install install) {
+    Run<variant> interpreted(seed);
+    interpreted.slices();
+
+    Run<variant> recompiled(seed);
+    size_t installed = install(recompiled.machine.cpu);
+    recompiled.slices();
+
+    if (installed == 0) {
+        std::printf("%s: no blocks installed\n", name);
+        return 1;
+    }
+
+    return MachineState::of(recompiled.machine).same(MachineState::of(interpreted.machine), name) ? 0 : 1;
+}
+
+int main() {
+    int programs = 0;
+    int failures = 0;
+
+#define PROGRAM(variant, name, seed) \
+    programs++; \
+    failures += check<Variant::variant>(#name, seed, [](auto& cpu) { return name::install(cpu); });
+
+    PROGRAMS
+
+#undef PROGRAM
+
+    std::printf("%d programs, %d failures\n", programs, failures);
+    return failures == 0 ? 0 : 1;
+}
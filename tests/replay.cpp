@@ -0,0 +1,81 @@
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include <unistd.h>
+
+#include "program.h"
+
+// Records random programs running with inputs, a device and interrupts at
+// random cycles, to a file. Then replays the file into a machine whose
+// device holds other values and whose interrupts never come by themselves,
+// and checks it ends in the state the recording did without diverging:
+//     - blocks   replayed through the predecoded and threaded code
+//     - jit      replayed with the x86-64 JIT, where the host has it
+
+constexpr int PROGRAMS = 100;
+
+template <Variant variant>
+int check(uint32_t seed, const std::string& path) {
+    char what[64];
+    std::string error;
+
+    Run<variant> recorded(seed, true);
+    {
+        InputLog log;
+        if (!recorded.machine.record(log, path, error)) {
+            std::printf("%s\n", error.c_str());
+            return 1;
+        }
+        recorded.slices();
+    }
+
+    MachineState expected = MachineState::of(recorded.machine);
+    expected.devices.clear();
+
+    int failures = 0;
+
+    for (bool jit: {false, true}) {
+        Run<variant> replayed(seed);
+        if (jit && !replayed.machine.cpu.enableJit()) continue;
+
+        NoiseDevice other(~seed);
+        replayed.machine.addPeripheral(&other);
+
+        InputLog log;
+        if (!log.load(path, error)) {
+            std::printf("%s\n", error.c_str());
+            return failures + 1;
+        }
+        replayed.machine.replay(log);
+        replayed.slices();
+
+        std::snprintf(what, sizeof(what), "%s seed %u %s", variantNames[(int)variant], seed, jit ? "jit" : "blocks");
+
+        MachineState state = MachineState::of(replayed.machine);
+        state.devices.clear();
+        failures += state.same(expected, what) ? 0 : 1;
+
+        if (log.diverged()) {
+            std::printf("%s: replay diverged\n", what);
+            failures++;
+        }
+    }
+
+    return failures;
+}
+
+int main() {
+    std::string path = "/tmp/replay-test-" + std::to_string(getpid()) + ".log";
+    int failures = 0;
+
+    for (uint32_t seed = 0; seed < PROGRAMS; seed++) {
+        failures += check<Variant::NMOS>(seed, path);
+        failures += check<Variant::CMOS>(seed, path);
+    }
+
+    std::remove(path.c_str());
+
+    std::printf("%d programs, %d failures\n", PROGRAMS * 2, failures);
+    return failures == 0 ? 0 : 1;
+}
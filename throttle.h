@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <thread>
+
+/*
+Paces the CPU against the wall clock. The CPU runs a batch of cycles (one
+millisecond of emulated time) flat out, then pace() waits until the wall
+clock catches up, so the interpreter loop itself never touches a timer.
+In turbo mode nothing is waited for, batches are 16M cycles and the
+achieved speed is reported.
+*/
+
+class Throttle {
+    using Clock = std::chrono::steady_clock;
+
+    // Sleeping is coarse, the last stretch before the deadline is spun
+    static constexpr std::chrono::microseconds spinMargin{200};
+
+    // Falling further behind than this (host stall, debugger) is not caught up
+    static constexpr std::chrono::milliseconds maxLag{50};
+
+    static constexpr uint64_t TURBO_BATCH = 1 << 24;
+
+    double hz;
+    bool turbo;
+
+    Clock::time_point startTime;
+    uint64_t startCycles = 0;
+
+    Clock::time_point reportTime;
+    uint64_t reportCycles = 0;
+
+    public:
+        explicit Throttle(double hz=1e6, bool turbo=false) : hz(hz), turbo(turbo) {}
+
+        bool isTurbo() const {
+            return turbo;
+        }
+
+        // Turbo runs nothing between batches but the speed report, so they are long
+        uint64_t batchCycles() const {
+            if (turbo) return TURBO_BATCH;
+
+            uint64_t cycles = hz / 1000;
+            return cycles > 0 ? cycles : 1;
+        }
+
+        void start(uint64_t cycles) {
+            startTime = reportTime = Clock::now();
+            startCycles = reportCycles = cycles;
+        }
+
+        void pace(uint64_t cycles) {
+            if (turbo) {
+                report(cycles);
+                return;
+            }
+
+            auto emulated = std::chrono::duration<double>((cycles - startCycles) / hz);
+            auto deadline = startTime + std::chrono::duration_cast<Clock::duration>(emulated);
+            auto now = Clock::now();
+
+            if (now - deadline > maxLag) {
+                startTime = now;
+                startCycles = cycles;
+                return;
+            }
+
+            if (deadline - now > spinMargin) std::this_thread::sleep_until(deadline - spinMargin);
+            while (Clock::now() < deadline) {}
+        }
+
+        // Achieved speed in MHz since start()
+        double mhz(uint64_t cycles) const {
+            std::chrono::duration<double> elapsed = Clock::now() - startTime;
+            if (elapsed.count() <= 0) return 0;
+
+            return (cycles - startCycles) / elapsed.count() / 1e6;
+        }
+
+    private:
+        void report(uint64_t cycles) {
+            auto now = Clock::now();
+            std::chrono::duration<double> elapsed = now - reportTime;
+            if (elapsed.count() < 1.0) return;
+
+            std::fprintf(stderr, "%.2f MHz\n", (cycles - reportCycles) / elapsed.count() / 1e6);
+
+            reportTime = now;
+            reportCycles = cycles;
+        }
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "opcodes.h"
+
+/*
+Trace policies for CPU<Trace>. The policy is a template argument, so CPU<NoTrace>
+has no trace code at all and traced CPUs never test a debug flag per instruction.
+    - NoTrace       nothing is recorded (what CPU(false) used to be)
+    - RingTrace     the last N instructions kept in memory, dumped on demand
+    - StreamTrace   records buffered and written out in bulk (what CPU(true) used to be)
+*/
+
+// CPU state before an instruction executes
+struct TraceRecord {
+    uint64_t cycle;
+    uint16_t pc;
+    uint8_t opcode;
+    uint8_t accumulator;
+    uint8_t x, y;
+    uint8_t sp;
+    uint8_t psr;
+
+    // Picks the opcode table the record is disassembled with
+    Variant variant;
+};
+
+inline int formatTrace(const TraceRecord& record, char* line, size_t size) {
+    const Opcode& opcode = opcodeTableFor(record.variant)[record.opcode];
+
+    return std::snprintf(line, size, "%04x  %02x  %s %-6s  A=%02x X=%02x Y=%02x SP=%02x P=%02x  CYC=%llu\n",
+        record.pc, record.opcode, opcode.mnemonic(), modeNames[opcode.mode],
+        record.accumulator, record.x, record.y, record.sp, record.psr,
+        (unsigned long long)record.cycle);
+}
+
+struct NoTrace {
+    static constexpr bool enabled = false;
+
+    void record(const TraceRecord&) {}
+    void flush() {}
+};
+
+class RingTrace {
+    std::vector<TraceRecord> records;
+    size_t mask;
+    uint64_t total = 0;
+
+    public:
+        static constexpr bool enabled = true;
+
+        // Capacity is rounded up to a power of two
+        explicit RingTrace(size_t capacity=1 << 16) {
+            size_t size = 1;
+            while (size < capacity) size <<= 1;
+
+            records.resize(size);
+            mask = size - 1;
+        }
+
+        void record(const TraceRecord& record) {
+            records[total & mask] = record;
+            total++;
+        }
+
+        void flush() {}
+
+        uint64_t size() const {
+            return total < records.size() ? total : records.size();
+        }
+
+        // Oldest first
+        void dump(std::ostream& out) const {
+            std::string text;
+            char line[96];
+
+            for (uint64_t i = total - size(); i < total; i++) {
+                int length = formatTrace(records[i & mask], line, sizeof(line));
+                text.append(line, length);
+            }
+
+            out << text;
+            out.flush();
+        }
+};
+
+class StreamTrace {
+    std::FILE* file;
+    bool binary;
+
+    std::vector<TraceRecord> buffer;
+    size_t count = 0;
+
+    public:
+        static constexpr bool enabled = true;
+
+        explicit StreamTrace(std::FILE* file=stdout, bool binary=false, size_t capacity=4096)
+            : file(file), binary(binary), buffer(capacity) {}
+
+        StreamTrace(const StreamTrace&) = delete;
+        StreamTrace& operator=(const StreamTrace&) = delete;
+
+        ~StreamTrace() {
+            flush();
+        }
+
+        void record(const TraceRecord& record) {
+            buffer[count++] = record;
+            if (count == buffer.size()) flush();
+        }
+
+        // One write per batch instead of one per instruction
+        void flush() {
+            if (count == 0) return;
+
+            if (binary) {
+                std::fwrite(buffer.data(), sizeof(TraceRecord), count, file);
+            } else {
+                std::string text;
+                char line[96];
+
+                for (size_t i = 0; i < count; i++) {
+                    int length = formatTrace(buffer[i], line, sizeof(line));
+                    text.append(line, length);
+                }
+
+                std::fwrite(text.data(), 1, text.size(), file);
+            }
+
+            std::fflush(file);
+            count = 0;
+        }
+};